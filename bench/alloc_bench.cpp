@@ -0,0 +1,67 @@
+/*
+  Throughput of a script that allocates short-lived strings and closures,
+  with the nursery and with everything allocated straight into the pools.
+*/
+
+#include "../simple_lisp.h"
+#include <chrono>
+
+#define Runs 5
+
+// every step of churn makes 3 strings and a closure that die right away,
+// only strings are concatenated so formatting numbers doesn't dominate
+static const char *Source =
+    "(defun label [s] (str \"item-\" s))\n"
+    "(defun suffix [s] #(str s \"!\"))\n"
+    "(defun churn [n]\n"
+    "  (label \"a\")\n"
+    "  ((suffix (label \"b\")))\n"
+    "  (if (= n 0) #0 #(churn (- n 1))))\n"
+    "(defun outer [k]\n"
+    "  (churn 1000)\n"
+    "  (if (= k 0) #0 #(outer (- k 1))))\n"
+    "(outer 1000)\n";
+
+#define AllocsPerRun (4.0*1001*1001)
+
+static double Run(size_t NurserySize, sl_gc_stats *Stats)
+{
+    double Best = 0;
+    for (int i = 0; i < Runs; i++)
+    {
+        sl_script Script;
+        CompileScript(&Script, Source);
+
+        sl_vm Vm;
+        Vm.NurserySize = NurserySize;
+        InitVM(&Vm);
+
+        auto Start = std::chrono::steady_clock::now();
+        Execute(&Vm, &Script);
+        double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+        if (i == 0 || Seconds < Best)
+        {
+            Best = Seconds;
+            *Stats = *GetGCStats(&Vm);
+        }
+    }
+    return Best;
+}
+
+int main(int argc, char **argv)
+{
+    sl_gc_stats PoolStats;
+    sl_gc_stats NurseryStats;
+    double PoolTime = Run(0, &PoolStats);
+    double NurseryTime = Run(sl_vm().NurserySize, &NurseryStats);
+
+    printf("pools:   %8.3f ms  %6.2f M allocs/s  %llu major, max pause %.3f ms\n",
+           PoolTime*1000.0, AllocsPerRun/PoolTime/1e6,
+           (unsigned long long)PoolStats.Cycles, PoolStats.MaxPause*1000.0);
+    printf("nursery: %8.3f ms  %6.2f M allocs/s  %llu major, %llu minor, max pause %.3f ms\n",
+           NurseryTime*1000.0, AllocsPerRun/NurseryTime/1e6,
+           (unsigned long long)NurseryStats.Cycles, (unsigned long long)NurseryStats.MinorCycles,
+           NurseryStats.MaxPause*1000.0);
+    printf("speedup: %.2fx\n", PoolTime/NurseryTime);
+    return 0;
+}
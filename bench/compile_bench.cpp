@@ -0,0 +1,41 @@
+/*
+  Compile throughput on synthetic sources with a growing number of distinct
+  symbols, strings and numbers. Interning should keep this linear.
+*/
+
+#include "../simple_lisp.h"
+#include <chrono>
+#include <string>
+
+static std::string MakeSource(int SymbolCount)
+{
+    std::string Source;
+    char Buf[128];
+    for (int i = 0; i < SymbolCount; i++)
+    {
+        snprintf(Buf, sizeof(Buf), "(def sym%d (+ %d.5 sym%d))\n", i, i, i/2);
+        Source += Buf;
+    }
+    return Source;
+}
+
+int main(int argc, char **argv)
+{
+    int Counts[] = { 10000, 100000, 1000000 };
+    for (int Count : Counts)
+    {
+        std::string Source = MakeSource(Count);
+
+        auto Start = std::chrono::steady_clock::now();
+        sl_script Script;
+        Script.Filename = (char *)"bench";
+        CompileScript(&Script, Source.c_str());
+        auto End = std::chrono::steady_clock::now();
+
+        double Seconds = std::chrono::duration<double>(End - Start).count();
+        printf("%8d symbols: %8.3f ms  %10.0f symbols/s  (%d strings, %d numbers)\n",
+               Count, Seconds*1000.0, Count/Seconds,
+               (int)Script.Strings.size(), Script.NumberCount);
+    }
+    return 0;
+}
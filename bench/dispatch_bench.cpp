@@ -0,0 +1,92 @@
+/*
+  Time spent in the interpreter loop on scripts that do little besides
+  dispatching opcodes. Built twice by the Makefile, with threaded dispatch
+  and with -DSL_SWITCH_DISPATCH, to compare the two. Every script runs
+  compiled to the stack form of the operators and to the register form.
+*/
+
+#include "../simple_lisp.h"
+#include <chrono>
+
+#define Runs 5
+
+struct bench_script
+{
+    const char *Name;
+    const char *Source;
+};
+
+static bench_script Scripts[] = {
+    {"fib 27",
+     "(defun fib [n] (if (< n 2) #n #(+ (fib (- n 1)) (fib (- n 2)))))\n"
+     "(fib 27)\n"},
+    {"count 3M",
+     "(defun inner [n acc] (if (= n 0) #acc #(inner (- n 1) (+ acc 7))))\n"
+     "(defun outer [k acc] (if (= k 0) #acc #(outer (- k 1) (inner 1000 acc))))\n"
+     "(outer 3000 0)\n"},
+    {"locals 2M",
+     "(defun mix [a b c] (def d (* a 3)) (def e (- d b)) (+ (* e c) (/ d 3)))\n"
+     "(defun loop [n] (mix n 2 5) (if (= n 0) #0 #(loop (- n 1))))\n"
+     "(defun outer [k] (loop 1000) (if (= k 0) #0 #(outer (- k 1))))\n"
+     "(outer 2000)\n"},
+    {"poly 1M",
+     "(defun poly [x y] (def a (+ (* x x) (* 3 y))) (def b (- (* a 2) (/ y 4)))\n"
+     "  (if (< a b) #(- b a) #(+ (* b b) (- a y))))\n"
+     "(defun loop [n] (poly n 7) (if (= n 0) #0 #(loop (- n 1))))\n"
+     "(defun outer [k] (loop 1000) (if (= k 0) #0 #(outer (- k 1))))\n"
+     "(outer 1000)\n"},
+};
+
+static int CodeSize(sl_script *Script)
+{
+    int Size = Script->Code.Size;
+    for (auto Func : Script->Funcs)
+    {
+        Size += Func->Code.Size;
+    }
+    return Size;
+}
+
+static double Run(const char *Source, bool RegisterOps, int *Size)
+{
+    double Best = 0;
+    for (int i = 0; i < Runs; i++)
+    {
+        sl_script Script;
+        Script.RegisterOps = RegisterOps;
+        CompileScript(&Script, Source);
+        *Size = CodeSize(&Script);
+
+        sl_vm Vm;
+        InitVM(&Vm);
+
+        auto Start = std::chrono::steady_clock::now();
+        Execute(&Vm, &Script);
+        double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+        if (i == 0 || Seconds < Best)
+        {
+            Best = Seconds;
+        }
+    }
+    return Best;
+}
+
+int main(int argc, char **argv)
+{
+#ifdef SL_THREADED_DISPATCH
+    const char *Dispatch = "threaded";
+#else
+    const char *Dispatch = "switch";
+#endif
+    for (size_t i = 0; i < sizeof(Scripts)/sizeof(Scripts[0]); i++)
+    {
+        int StackSize;
+        int RegisterSize;
+        double StackTime = Run(Scripts[i].Source, false, &StackSize);
+        double RegisterTime = Run(Scripts[i].Source, true, &RegisterSize);
+        printf("%-8s  %-10s stack %8.3f ms (%4d bytes)  register %8.3f ms (%4d bytes)  %.2fx\n",
+               Dispatch, Scripts[i].Name, StackTime*1000.0, StackSize,
+               RegisterTime*1000.0, RegisterSize, StackTime/RegisterTime);
+    }
+    return 0;
+}
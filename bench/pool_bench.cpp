@@ -0,0 +1,89 @@
+/*
+  sl_pool against plain malloc/free for objects the size of a coroutine:
+  allocating a batch and freeing it in the same order, in reverse order, and
+  a steady churn where random live objects get replaced.
+*/
+
+#include "../simple_lisp.h"
+#include <chrono>
+
+#define ObjectCount 100000
+#define Rounds 20
+
+static uint32 Random(uint32 *State)
+{
+    *State ^= *State << 13;
+    *State ^= *State >> 17;
+    *State ^= *State << 5;
+    return *State;
+}
+
+static void *PoolAlloc(void *Pool, size_t Size) { return GetObject((sl_pool *)Pool); }
+static void PoolFree(void *Pool, void *Data) { FreeObject((sl_pool *)Pool, Data); }
+static void *HeapAlloc(void *Pool, size_t Size) { return malloc(Size); }
+static void HeapFree(void *Pool, void *Data) { free(Data); }
+
+typedef void *alloc_func(void *Pool, size_t Size);
+typedef void free_func(void *Pool, void *Data);
+
+// touches every object like the vm does when it initializes one
+static double Run(const char *Pattern, alloc_func *Alloc, free_func *Free, void *Pool)
+{
+    static void *Objects[ObjectCount];
+    size_t Size = sizeof(sl_coroutine);
+    uint32 State = 0x12345678;
+
+    auto Start = std::chrono::steady_clock::now();
+    for (int Round = 0; Round < Rounds; Round++)
+    {
+        for (int i = 0; i < ObjectCount; i++)
+        {
+            Objects[i] = Alloc(Pool, Size);
+            memset(Objects[i], 0, Size);
+        }
+
+        if (strcmp(Pattern, "churn") == 0)
+        {
+            for (int i = 0; i < ObjectCount*4; i++)
+            {
+                int Index = Random(&State) % ObjectCount;
+                Free(Pool, Objects[Index]);
+                Objects[Index] = Alloc(Pool, Size);
+                memset(Objects[Index], 0, Size);
+            }
+        }
+
+        if (strcmp(Pattern, "lifo") == 0)
+        {
+            for (int i = ObjectCount - 1; i >= 0; --i)
+            {
+                Free(Pool, Objects[i]);
+            }
+        }
+        else
+        {
+            for (int i = 0; i < ObjectCount; i++)
+            {
+                Free(Pool, Objects[i]);
+            }
+        }
+    }
+    auto End = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(End - Start).count();
+}
+
+int main(int argc, char **argv)
+{
+    const char *Patterns[] = { "fifo", "lifo", "churn" };
+    for (const char *Pattern : Patterns)
+    {
+        sl_pool Pool;
+        Pool.ElemSize = sizeof(sl_coroutine);
+
+        double PoolSeconds = Run(Pattern, PoolAlloc, PoolFree, &Pool);
+        double HeapSeconds = Run(Pattern, HeapAlloc, HeapFree, NULL);
+        printf("%-6s pool: %8.3f ms  malloc: %8.3f ms  (%.2fx)\n",
+               Pattern, PoolSeconds*1000.0, HeapSeconds*1000.0, HeapSeconds/PoolSeconds);
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*
+  Startup time of a large script: compiling from source against loading the
+  precompiled image written by WriteScript.
+*/
+
+#include "../simple_lisp.h"
+#include <chrono>
+#include <string>
+
+#define Runs 10
+
+static void MakeSource(const char *Filename, int FuncCount)
+{
+    FILE *Handle = fopen(Filename, "w");
+    for (int i = 0; i < FuncCount; i++)
+    {
+        fprintf(Handle,
+                "(defun func%d [a b]\n"
+                "  (def tmp (* (+ a %d.25) b))\n"
+                "  (println \"func%d\" tmp (- tmp func%d)))\n",
+                i, i, i, i/2);
+    }
+    fprintf(Handle, "(println (func%d 1 2))\n", FuncCount - 1);
+    fclose(Handle);
+}
+
+template <typename F>
+static double Time(F Fn)
+{
+    auto Start = std::chrono::steady_clock::now();
+    for (int i = 0; i < Runs; i++)
+    {
+        Fn();
+    }
+    auto End = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(End - Start).count()*1000.0/Runs;
+}
+
+int main(int argc, char **argv)
+{
+    const char *SourceFile = "bench/startup_bench.sl";
+    const char *ImageFile = "bench/startup_bench.slc";
+    int Counts[] = { 1000, 10000, 50000 };
+
+    for (int Count : Counts)
+    {
+        MakeSource(SourceFile, Count);
+        {
+            sl_script Script;
+            Script.Filename = (char *)SourceFile;
+            sl_file_data Source = ReadFile(SourceFile);
+            CompileScript(&Script, Source.Data);
+            FreeFileData(Source.Data, Source.MapSize);
+            WriteScript(&Script, ImageFile);
+        }
+
+        double SourceMs = Time([&]() {
+            sl_script Script;
+            Script.Filename = (char *)SourceFile;
+            sl_file_data Source = ReadFile(SourceFile);
+            CompileScript(&Script, Source.Data);
+            FreeFileData(Source.Data, Source.MapSize);
+        });
+        double ImageMs = Time([&]() {
+            sl_script Script;
+            Script.Filename = (char *)ImageFile;
+            LoadScriptFile(&Script, ImageFile);
+        });
+
+        printf("%6d funcs: source %8.3f ms  image %8.3f ms  (%.1fx)\n",
+               Count, SourceMs, ImageMs, SourceMs/ImageMs);
+    }
+
+    remove(SourceFile);
+    remove(ImageFile);
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+  Recursion in tail position at growing depths. With tail calls the frame and
+  operand stacks stay the same size however deep it goes, without them only
+  the depth that fits in MaxFrames runs, to compare the cost of a call.
+*/
+
+#include "../simple_lisp.h"
+#include <chrono>
+
+#define Runs 5
+
+struct bench_script
+{
+    const char *Name;
+    const char *Source;
+    double Calls;
+};
+
+// the depth that fits in MaxFrames is the first of each kind
+static bench_script Scripts[] = {
+    {"loop 4K",
+     "(defun loop [n] (if (= n 0) #0 #(loop (- n 1))))\n"
+     "(loop 4000)\n", 4001},
+    {"loop 1M",
+     "(defun loop [n] (if (= n 0) #0 #(loop (- n 1))))\n"
+     "(loop 1000000)\n", 1000001},
+    {"loop 10M",
+     "(defun loop [n] (if (= n 0) #0 #(loop (- n 1))))\n"
+     "(loop 10000000)\n", 10000001},
+    {"even/odd 4K",
+     "(defun even [n] (if (= n 0) #true #(odd (- n 1))))\n"
+     "(defun odd [n] (if (= n 0) #false #(even (- n 1))))\n"
+     "(even 4000)\n", 4001},
+    {"even/odd 10M",
+     "(defun even [n] (if (= n 0) #true #(odd (- n 1))))\n"
+     "(defun odd [n] (if (= n 0) #false #(even (- n 1))))\n"
+     "(even 10000000)\n", 10000001},
+};
+
+static double Run(const char *Source, bool TailCalls, int *StackSize)
+{
+    double Best = 0;
+    for (int i = 0; i < Runs; i++)
+    {
+        sl_script Script;
+        Script.TailCalls = TailCalls;
+        CompileScript(&Script, Source);
+
+        sl_vm Vm;
+        InitVM(&Vm);
+
+        auto Start = std::chrono::steady_clock::now();
+        Execute(&Vm, &Script);
+        double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+        if (i == 0 || Seconds < Best)
+        {
+            Best = Seconds;
+        }
+        *StackSize = Vm.StackSize;
+    }
+    return Best;
+}
+
+int main(int argc, char **argv)
+{
+    for (size_t i = 0; i < sizeof(Scripts)/sizeof(Scripts[0]); i++)
+    {
+        bench_script *Bench = &Scripts[i];
+        int TailStack;
+        double TailTime = Run(Bench->Source, true, &TailStack);
+        printf("%-13s  tail call %9.3f ms  %5.2f ns/call  stack %7d slots",
+               Bench->Name, TailTime*1000.0, TailTime*1e9/Bench->Calls, TailStack);
+
+        if (Bench->Calls < MaxFrames)
+        {
+            int CallStack;
+            double CallTime = Run(Bench->Source, false, &CallStack);
+            printf("  |  call %9.3f ms  %5.2f ns/call  stack %7d slots",
+                   CallTime*1000.0, CallTime*1e9/Bench->Calls, CallStack);
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -1,23 +1,111 @@
 #include "simple_lisp.h"
 
+static void Usage()
+{
+    printf("usage: sl [-d] [-n] [-g] [-p] [-c output] file\n"
+           "  -d         print the disassembly before running\n"
+           "  -n         don't optimize the bytecode, -d then shows it as parsed\n"
+           "  -g         print garbage collector pause times after running\n"
+           "  -p         print the most frequent opcode pairs after running, needs a\n"
+           "             build with SL_PROFILE_OPCODES\n"
+           "  -c output  compile file to a precompiled image instead of running it\n");
+}
+
 int main(int argc, char **argv)
 {
-    if (argc < 2)
+    const char *Input = NULL;
+    const char *Output = NULL;
+    bool ShowDisasm = false;
+    bool Optimize = true;
+    bool ShowGCStats = false;
+    bool ShowProfile = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-d") == 0)
+        {
+            ShowDisasm = true;
+        }
+        else if (strcmp(argv[i], "-n") == 0)
+        {
+            Optimize = false;
+        }
+        else if (strcmp(argv[i], "-g") == 0)
+        {
+            ShowGCStats = true;
+        }
+        else if (strcmp(argv[i], "-p") == 0)
+        {
+            ShowProfile = true;
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            Output = argv[++i];
+        }
+        else if (argv[i][0] == '-' && argv[i][1])
+        {
+            Usage();
+            exit(EXIT_FAILURE);
+        }
+        else
+        {
+            Input = argv[i];
+        }
+    }
+
+    if (!Input)
     {
         printf("simple_lisp: error: no input files\n");
         exit(EXIT_FAILURE);
     }
 
-    const char *Source = ReadFile(argv[1]);
-
     sl_script Script;
-    Script.Filename = argv[1];
-    CompileScript(&Script, Source);
-    Disasm(&Script);
+    Script.Filename = (char *)Input;
+    Script.Optimize = Optimize;
+    if (IsImageFile(Input))
+    {
+        if (!LoadScriptFile(&Script, Input))
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        sl_file_data Source = ReadFile(Input);
+        if (!Source.Data)
+        {
+            printf("simple_lisp: error: can't read '%s'\n", Input);
+            exit(EXIT_FAILURE);
+        }
+        CompileScript(&Script, Source.Data);
+        FreeFileData(Source.Data, Source.MapSize);
+    }
+
+    if (ShowDisasm)
+    {
+        Disasm(&Script);
+    }
+
+    if (Output)
+    {
+        return WriteScript(&Script, Output) ? 0 : EXIT_FAILURE;
+    }
 
     sl_vm Vm;
     InitVM(&Vm);
     Execute(&Vm, &Script);
+    if (ShowGCStats)
+    {
+        PrintGCStats(&Vm);
+    }
+    if (ShowProfile)
+    {
+#ifdef SL_PROFILE_OPCODES
+        PrintOpCodeProfile(&Vm);
+#else
+        printf("simple_lisp: error: -p needs a build with SL_PROFILE_OPCODES\n");
+#endif
+    }
 
     return 0;
 }
@@ -13,10 +13,20 @@
 #include <cassert>
 #include <cstdint>
 #include <vector>
+#include <algorithm>
 #include <unordered_map>
+#include <string>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <chrono>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define IsDigit(Char) (Char >= '0' && Char <= '9')
 #define IsSymbol(Char) ((Char >= 'a' && Char <= 'z') || \
@@ -27,9 +37,13 @@
                         (Char == '*') || \
                         (Char == '/') || \
                         (Char == '?') || \
+                        (Char == '<') || \
+                        (Char == '>') || \
+                        (Char == '=') || \
                         (Char == '.'))
 
-#define Is(Value, T) (Value.Type == ValueType_##T)
+#define Is(Value, T) IsType(Value, ValueType_##T)
+#define IsFalse(Value) ((Is(Value, Bool) && !AsBool(Value)) || Is(Value, Nil))
 
 #define NATIVE_FUNC(name) void name(void *Data, sl_vm *Vm, sl_value *Args, int ArgCount)
 
@@ -45,6 +59,7 @@ enum sl_token_type
     TokenType_RightBracket,
     TokenType_String,
     TokenType_Number,
+    TokenType_Fixnum,
     TokenType_Symbol,
     TokenType_Hash,
 };
@@ -52,31 +67,118 @@ enum sl_token_type
 enum sl_opcode
 {
     OpCode_Halt,
-    OpCode_Defun,
-    OpCode_Def,
-    OpCode_Defonce,
-    OpCode_Set,
     OpCode_FuncCall,
+
+    // a FuncCall whose result is returned right away, the callee takes over
+    // the frame of the caller. It's followed by the Return a generic call
+    // goes through.
+    OpCode_TailCall,
+    OpCode_LoadNil,
     OpCode_LoadBool,
     OpCode_LoadString,
     OpCode_LoadNumber,
-    OpCode_LoadSymbol,
+    OpCode_LoadFixnum,
+    OpCode_LoadLocal,
+    OpCode_LoadUpvalue,
+    OpCode_LoadCell,
+    OpCode_LoadGlobal,
+    OpCode_LoadSelf,
     OpCode_LoadFunc,
+    OpCode_StoreLocal,
+    OpCode_StoreUpvalue,
+    OpCode_StoreCell,
+    OpCode_StoreGlobal,
+    OpCode_DefonceLocal,
+    OpCode_DefonceCell,
+    OpCode_DefonceGlobal,
+
+    // wraps the value of the local slot Arg in a cell, run when the function
+    // starts for the locals nested functions capture. LoadCell, StoreCell and
+    // DefonceCell go through the cell in the slot, see sl_cell.
+    OpCode_MakeCell,
     OpCode_Return,
     OpCode_Pop,
+
+    // Arg is the code offset to jump to, always encoded wide so it can be
+    // patched once the target is known
+    OpCode_Jump,
+    OpCode_JumpIfFalse,
+
+    // binary operators, Arg is the global site of the operator so the
+    // generic call can be made when it's not the builtin or not a number
+    OpCode_Add,
+    OpCode_Sub,
+    OpCode_Mul,
+    OpCode_Div,
+    OpCode_Lt,
+    OpCode_Gt,
+    OpCode_Eq,
+
+    // register forms of the binary operators, Arg is the global site as above
+    // and it's followed by three bytes: the two operands and the destination,
+    // see RegImmediate. RR reads both operands in place, SR pops the first.
+    // A destination other than RegStack is followed by the instruction the
+    // generic call goes through: a StoreLocal for a local slot, the
+    // JumpIfFalse of a conditional for RegBranch.
+    OpCode_AddRR,
+    OpCode_SubRR,
+    OpCode_MulRR,
+    OpCode_DivRR,
+    OpCode_LtRR,
+    OpCode_GtRR,
+    OpCode_EqRR,
+    OpCode_AddSR,
+    OpCode_SubSR,
+    OpCode_MulSR,
+    OpCode_DivSR,
+    OpCode_LtSR,
+    OpCode_GtSR,
+    OpCode_EqSR,
+
+    // prefix for operands that don't fit in a byte, see Emit
+    OpCode_Wide,
 };
 
+// Operands of the register operators: a local slot below RegImmediate, or a
+// fixnum from RegImmediateMin to RegImmediateMax stored plus RegImmediateBias.
+// RegStack is an operand on the stack, as a destination it pushes. RegBranch
+// is only a destination, the result is tested by the JumpIfFalse after it.
+#define RegImmediate 0x80
+#define RegImmediateBias 0xC0
+#define RegBranch 0xFE
+#define RegStack 0xFF
+#define RegImmediateMin (RegImmediate - RegImmediateBias)
+#define RegImmediateMax (RegBranch - 1 - RegImmediateBias)
+
+#define OpCodeCount (OpCode_Wide + 1)
+
+#ifdef SL_PROFILE_OPCODES
+// in sl_opcode order
+static const char *OpCodeNames[] = {
+    "Halt", "FuncCall", "TailCall", "LoadNil", "LoadBool", "LoadString",
+    "LoadNumber", "LoadFixnum", "LoadLocal", "LoadUpvalue", "LoadCell", "LoadGlobal",
+    "LoadSelf", "LoadFunc", "StoreLocal", "StoreUpvalue", "StoreCell", "StoreGlobal",
+    "DefonceLocal", "DefonceCell", "DefonceGlobal", "MakeCell", "Return", "Pop", "Jump", "JumpIfFalse", "Add", "Sub", "Mul",
+    "Div", "Lt", "Gt", "Eq", "AddRR", "SubRR", "MulRR", "DivRR", "LtRR", "GtRR", "EqRR", "AddSR",
+    "SubSR", "MulSR", "DivSR", "LtSR", "GtSR", "EqSR", "Wide",
+};
+#endif
+
 struct sl_lexer
 {
     const char *Source;
     const char *Ptr;
 
     sl_token_type TokenType;
+
+    // symbol and string tokens are views into Source, they only get copied
+    // when interned by AddString
     int StringSize;
     union
     {
-        float NumberVal;
-        char *StringVal;
+        double NumberVal;
+        int64_t FixnumVal;
+        const char *StringVal;
     };
 };
 
@@ -87,815 +189,4257 @@ struct sl_code
     uint8 *Data = NULL;
 };
 
-struct sl_pool_entry
+// objects per chunk of a pool
+#define PoolChunkSize 256
+
+// chunks are followed by PoolChunkSize objects
+struct sl_pool_chunk
 {
-    void *Data;
-    sl_pool_entry *Next = NULL;
+    sl_pool_chunk *Next;
+    void *Padding;
 };
 
+// A slab allocator, objects are carved out of chunks that are never given
+// back. Free objects keep the pointer to the next free one in their first
+// bytes, so both getting and putting an object are O(1).
 struct sl_pool
 {
-    sl_pool_entry *First = NULL;
-    sl_pool_entry *FirstFree = NULL;
+    sl_pool_chunk *Chunks = NULL;
+    void *FirstFree = NULL;
     size_t ElemSize;
 
 #ifdef SL_DEBUG
-    char *DEBUGName;
+    const char *DEBUGName;
 #endif
 };
 
-struct sl_ref
+// header of every value that lives on the heap, see CollectGarbage
+struct sl_object
 {
-    sl_pool *Pool;
-    int RefCount;
+    // next in sl_vm::Objects, for young objects the copy they were promoted
+    // to once they survive a minor collection
+    sl_object *Next = NULL;
+
+    // NULL for the script's constant strings, which are never collected
+    sl_pool *Pool = NULL;
+
+    // bytes counted towards the next collection
+    size_t Size = 0;
+    uint8 Type = 0;
+    bool Marked = false;
+
+    // Young objects live in sl_vm::Nursery, Remembered old ones are on
+    // sl_vm::Remembered because they may point to young ones
+    bool Young = false;
+    bool Remembered = false;
 };
 
-struct sl_string : sl_ref
+struct sl_string : sl_object
 {
-    int Size = 0;
+    // 64 bits so strings read from files can go past 2GB, the script's
+    // constant strings always fit in an int
+    int64_t Size = 0;
+    uint32 Hash = 0;
     char *Value;
+
+    // non zero when Value is a file mapping, see ReadFile
+    long int MapSize = 0;
+};
+
+// open addressing table of indices into one of the script's constant pools
+struct sl_intern_slot
+{
+    uint32 Hash;
+    int Index; // -1 when empty
+};
+
+struct sl_intern_table
+{
+    int Count = 0;
+    int Capacity = 0;
+    sl_intern_slot *Slots = NULL;
+};
+
+enum sl_var_type
+{
+    VarType_Global,
+    VarType_Local,
+    VarType_Upvalue,
+    VarType_Self,
+};
+
+struct sl_var
+{
+    sl_var_type Type;
+    int Index;
+};
+
+// where a closure gets each of its upvalues from in the enclosing frame,
+// Type is VarType_Local or VarType_Upvalue. Either way it's the cell of the
+// captured variable, see sl_cell.
+struct sl_capture
+{
+    uint32 Type;
+    uint32 Index;
 };
 
-#define FuncMaxArgs 8
 struct sl_func
 {
     sl_code Code;
     int StringIndex;
-    int ArgCount;
-    int Args[FuncMaxArgs];
+    int ArgCount = 0;
+    int LocalCount = 0;
+
+    // deepest the operands of a call get, see ComputeMaxStack
+    int MaxStack = 0;
+    std::vector<sl_capture> Captures;
+};
+
+enum sl_def_type
+{
+    DefType_Def,
+    DefType_Defonce,
+    DefType_Set,
+};
+
+#define ArenaBlockSize (64 << 10)
+
+struct sl_arena_block
+{
+    sl_arena_block *Next;
+    void *Padding;
+};
+
+// A bump allocator for the nodes of one top level form, ResetArena keeps the
+// blocks so the next form reuses them. Allocations are at most ArenaBlockSize.
+struct sl_arena
+{
+    sl_arena_block *First = NULL;
+    sl_arena_block *Current = NULL;
+    size_t Used = 0;
+};
+
+enum sl_node_type
+{
+    NodeType_Nil,
+    NodeType_Bool,
+    NodeType_Fixnum,
+    NodeType_Number,
+    NodeType_String,
+    NodeType_Symbol,
+    NodeType_Call,
+    NodeType_Lambda,
+    NodeType_Def,
+    NodeType_Defun,
+    NodeType_Cond,
+};
+
+// The parser builds a tree of these for each top level form and GenExpr
+// compiles it, so the code generator can look at a whole expression before
+// emitting any of it.
+//
+//   Call    the callee then the arguments, OpCode is its operator opcode or
+//           OpCode_Halt
+//   Lambda  the body
+//   Def     the value
+//   Defun   ArgCount argument symbols then the body
+//   Cond    test and branch pairs, then the else branch when Count is odd
+struct sl_node
+{
+    sl_node_type Type;
+
+    // string index of a String, a Symbol or the name of a Def or Defun
+    int Name;
+
+    sl_node *Children;
+    sl_node *Next;
+    int Count;
+
+    union
+    {
+        bool Bool;
+        int64_t Fixnum;
+        double Number;
+        sl_opcode OpCode;
+        sl_def_type DefType;
+        int ArgCount;
+    };
+};
+
+// what GenExpr does with the value of an expression, Tail is the last
+// statement of a body, the value is returned so calls can be tail calls
+enum sl_value_use
+{
+    ValueUse_Push,
+    ValueUse_Pop,
+    ValueUse_Tail,
+};
+
+// compile time state of the function being parsed, Func is NULL at the top
+// level where every variable is global
+struct sl_scope
+{
+    sl_scope *Parent = NULL;
+    sl_func *Func = NULL;
+    sl_code *Code = NULL;
+    int SelfName = -1;
+
+    // string index of the name of each local slot and each upvalue
+    std::vector<int> Locals;
+    std::vector<int> Captures;
+
+    // for each local slot, Declared once the function's own code has reached
+    // its definition and Boxed when nested functions capture it, see GenFunc
+    std::vector<bool> Declared;
+    std::vector<bool> Boxed;
+};
+
+struct sl_value;
+
+// inline cache of a LoadGlobal, StoreGlobal or DefonceGlobal, Slot is valid
+// while Version matches sl_vm::GlobalVersion
+struct sl_global_site
+{
+    int StringIndex;
+    uint32 Version = 0;
+    sl_value *Slot = NULL;
 };
 
 struct sl_script
 {
     std::vector<sl_string> Strings;
-    std::vector<float> Numbers;
     std::vector<sl_func *> Funcs;
+    std::vector<sl_global_site> GlobalSites;
+
+    // point into the image when the script was loaded with LoadScript
+    double *Numbers = NULL;
+    int NumberCount = 0;
+    int NumberCapacity = 0;
+    int64_t *Fixnums = NULL;
+    int FixnumCount = 0;
+    int FixnumCapacity = 0;
+
+    const char *Image = NULL;
+    long int ImageSize = 0;
+
+    sl_intern_table StringTable;
+    sl_intern_table NumberTable;
+    sl_intern_table FixnumTable;
     sl_code Code;
+    int MaxStack = 0;
     char *Filename;
+
+    // set before CompileScript, false compiles operators to the stack form
+    // only, see OpCode_AddRR
+    bool RegisterOps = true;
+
+    // set before CompileScript, false leaves the code as parsed, see
+    // OptimizeCode
+    bool Optimize = true;
+
+    // set before CompileScript, false compiles every call to a FuncCall, see
+    // OpCode_TailCall
+    bool TailCalls = true;
 };
 
 enum sl_value_type
 {
     ValueType_Nil,
     ValueType_Bool,
-    ValueType_Number,
+    ValueType_Fixnum,
+    ValueType_Double,
     ValueType_String,
     ValueType_Func,
     ValueType_NativeFunc,
     ValueType_Coroutine,
+    ValueType_Closure,
     ValueType_Custom,
+
+    // only ever in the local slots of a frame and in upvalues, see sl_cell
+    ValueType_Cell,
     ValueTypeMax,
 };
 
 static const char *ValueTypeStrings[] = {
-    "nil", "bool", "number", "string", "func", "native_func", "coroutine", "custom"
+    "nil", "bool", "fixnum", "double", "string", "func", "native_func", "coroutine", "closure", "custom",
+    "cell"
 };
 
 struct sl_call_frame;
 struct sl_vm;
-struct sl_value;
 
 typedef NATIVE_FUNC(native_func);
 
-struct sl_native
+struct sl_native : sl_object
 {
     native_func *Func;
     void *Data;
 };
 
-struct sl_coroutine : sl_ref
+struct sl_closure;
+
+struct sl_coroutine : sl_object
 {
     sl_call_frame *Frame = NULL;
     sl_func *Func = NULL;
+    sl_closure *Closure = NULL;
+    bool Done = false;
+
+    // operands of the body frame while it's paused, the stack above the
+    // resumer gets reused so they're moved out on yield
+    sl_value *Saved = NULL;
+    int SavedCount = 0;
+};
+
+// Values are only touched through TypeOf, the As* accessors and the
+// constructors below, so the representation can be picked at compile time.
+#ifdef SL_NAN_BOXING
+
+// Doubles are stored as they are, everything else is a NaN that no arithmetic
+// produces: the type goes in the top 16 bits, above NanBoxBase, and a pointer,
+// bool or fixnum in the low 48. Fixnums that don't fit in 48 bits become
+// doubles.
+#define NanBoxBase 0xFFF1000000000000ull
+#define NanBoxPayload 0x0000FFFFFFFFFFFFull
+#define FixnumMin (-((int64_t)1 << 47))
+#define FixnumMax (((int64_t)1 << 47) - 1)
+
+struct sl_value
+{
+    uint64_t Bits = NanBoxBase;
 };
 
+#else
+
+#define FixnumMin INT64_MIN
+#define FixnumMax INT64_MAX
+
 struct sl_value
 {
     sl_value_type Type = ValueType_Nil;
     union
     {
-        sl_string *String;
-        sl_func *Func;
-        sl_native *Native;
-        sl_coroutine *Coroutine;
-        void *Custom;
-        float Number;
+        void *Pointer;
+        int64_t Fixnum;
+        double Double;
         bool Bool;
     };
 };
 
-#define MaxVars 255
-struct sl_call_frame
+#endif
+
+// a function with upvalues, functions that capture nothing are plain
+// ValueType_Func values
+struct sl_closure : sl_object
 {
-    sl_value Vars[MaxVars];
-    uint8 *CodePtr = NULL;
-    sl_coroutine *Coroutine = NULL;
-    sl_call_frame *Parent = NULL;
+    sl_func *Func;
+    sl_value *Upvalues;
 };
 
-struct sl_vm
+// A local that nested functions capture. Its slot holds the cell, and so
+// does the upvalue of every closure capturing it, so a set through any of
+// them is seen by all. Cells are never allocated young.
+struct sl_cell : sl_object
 {
-    std::unordered_map<std::string, sl_value> Globals;
-
-    sl_pool StringPool;
-    sl_pool CoroutinePool;
-    sl_value Stack[MaxVars];
-    int StackTop = 0;
-    sl_call_frame *CurrentFrame = NULL;
-    sl_script *CurrentScript = NULL;
+    sl_value Value;
 };
 
-static void ParseExpr(sl_script *Script, sl_code *Code, sl_lexer *Lexer, bool PopUnused = false);
+#ifdef SL_NAN_BOXING
 
-static void ParseSymbol(sl_lexer *Lexer)
+inline sl_value_type TypeOf(sl_value Value)
 {
-    const char *Beg = Lexer->Ptr;
-    while (IsSymbol(*Lexer->Ptr) || IsDigit(*Lexer->Ptr))
-    {
-        Lexer->Ptr++;
-    }
-
-    int Size = Lexer->Ptr - Beg;
-    char *Str = new char[Size + 1];
-    memcpy(Str, Beg, Size);
-    Str[Size] = '\0';
-
-    if (Lexer->StringVal)
+    if (Value.Bits < NanBoxBase)
     {
-        // @TODO
-        //delete[] Lexer->StringVal;
+        return ValueType_Double;
     }
-    Lexer->StringVal = Str;
-    Lexer->StringSize = Size;
+    return (sl_value_type)((Value.Bits - NanBoxBase) >> 48);
 }
 
-static void NextToken(sl_lexer *Lexer)
+// one compare once Type is a constant
+inline bool IsType(sl_value Value, sl_value_type Type)
 {
-    while (*Lexer->Ptr == ' ' ||
-           *Lexer->Ptr == '\n' ||
-           *Lexer->Ptr == '\t')
-    {
-        Lexer->Ptr++;
-    }
-
-    if (!(*Lexer->Ptr))
+    if (Type == ValueType_Double)
     {
-        Lexer->TokenType = TokenType_EOF;
-        return;
+        return Value.Bits < NanBoxBase;
     }
+    return (Value.Bits >> 48) == (NanBoxBase >> 48) + Type;
+}
 
-    switch (*Lexer->Ptr)
-    {
-    case '(':
-        Lexer->TokenType = TokenType_LeftParen;
-        Lexer->Ptr++;
-        break;
-
-    case ')':
-        Lexer->TokenType = TokenType_RightParen;
-        Lexer->Ptr++;
-        break;
+inline int64_t AsFixnum(sl_value Value)
+{
+    // sign extends the low 48 bits
+    return (int64_t)(Value.Bits << 16) >> 16;
+}
 
-    case '[':
-        Lexer->TokenType = TokenType_LeftBracket;
-        Lexer->Ptr++;
-        break;
+inline double AsDouble(sl_value Value)
+{
+    double Double;
+    memcpy(&Double, &Value.Bits, sizeof(Double));
+    return Double;
+}
 
-    case ']':
-        Lexer->TokenType = TokenType_RightBracket;
-        Lexer->Ptr++;
-        break;
+inline bool AsBool(sl_value Value)
+{
+    return Value.Bits & 1;
+}
 
-    case '#':
-        Lexer->TokenType = TokenType_Hash;
-        Lexer->Ptr++;
-        break;
+inline void *AsPointer(sl_value Value)
+{
+    return (void *)(uintptr_t)(Value.Bits & NanBoxPayload);
+}
 
-    case '"':
+inline sl_value CreateDouble(double Double)
+{
+    // every NaN becomes the positive quiet one, which is below NanBoxBase
+    sl_value Result;
+    if (Double != Double)
     {
-        Lexer->TokenType = TokenType_String;
-        Lexer->Ptr++;
-
-        const char *Beg = Lexer->Ptr;
-        while (*Lexer->Ptr != '"')
-        {
-            Lexer->Ptr++;
-        }
-
-        int Size = Lexer->Ptr - Beg;
-        char *Str = new char[Size + 1];
-        memcpy(Str, Beg, Size);
-        Str[Size] = '\0';
-
-        if (Lexer->StringVal)
-        {
-            delete[] Lexer->StringVal;
-        }
-        Lexer->StringVal = Str;
-        Lexer->StringSize = Size;
-
-        Lexer->Ptr++;
-        break;
+        Result.Bits = 0x7FF8000000000000ull;
     }
-
-    case '\'':
+    else
     {
-        Lexer->TokenType = TokenType_String;
-        Lexer->Ptr++;
-
-        if (IsSymbol(*Lexer->Ptr))
-        {
-            ParseSymbol(Lexer);
-        }
-        break;
-    }
-
-    default:
-        if (IsDigit(*Lexer->Ptr))
-        {
-            Lexer->TokenType = TokenType_Number;
-
-            const char *Beg = Lexer->Ptr;
-            while (IsDigit(*Lexer->Ptr) || *Lexer->Ptr == '.')
-            {
-                Lexer->Ptr++;
-            }
-
-            int Size = Lexer->Ptr - Beg;
-            char *Str = new char[Size + 1];
-            memcpy(Str, Beg, Size);
-            Str[Size] = '\0';
-
-            Lexer->NumberVal = (float)atof(Str);
-            delete[] Str;
-        }
-        else if (IsSymbol(*Lexer->Ptr))
-        {
-            Lexer->TokenType = TokenType_Symbol;
-            ParseSymbol(Lexer);
-        }
-        break;
+        memcpy(&Result.Bits, &Double, sizeof(Double));
     }
+    return Result;
 }
 
-static void InitLexer(sl_lexer *Lexer, const char *Source)
-{
-    Lexer->Source = Source;
-    Lexer->Ptr = Source;
-    Lexer->StringVal = NULL;
-    NextToken(Lexer);
-}
-
-static int AddString(sl_script *Script, const char *Value, int Size)
+inline sl_value CreateFixnum(int64_t Fixnum)
 {
-    // @TODO: use arena for allocation
-    for (int i = 0; i < Script->Strings.size(); i++)
+    if (Fixnum < FixnumMin || Fixnum > FixnumMax)
     {
-        auto &Str = Script->Strings[i];
-        if (strcmp(Value, Str.Value) == 0)
-        {
-            return i;
-        }
+        return CreateDouble((double)Fixnum);
     }
 
-    sl_string Str;
-    Str.Size = Size;
-    Str.Value = new char[Size+1];
-    memcpy(Str.Value, Value, Size+1);
-
-    Script->Strings.push_back(Str);
-    return Script->Strings.size() - 1;
+    sl_value Result;
+    Result.Bits = NanBoxBase + ((uint64_t)ValueType_Fixnum << 48) + ((uint64_t)Fixnum & NanBoxPayload);
+    return Result;
 }
 
-static int AddNumber(sl_script *Script, float Value)
+inline sl_value CreateBool(bool Value)
 {
-    for (int i = 0; i < Script->Numbers.size(); i++)
-    {
-        float Num = Script->Numbers[i];
-        if (Value == Num)
-        {
-            return i;
-        }
-    }
-    Script->Numbers.push_back(Value);
-    return Script->Numbers.size() - 1;
+    sl_value Result;
+    Result.Bits = NanBoxBase + ((uint64_t)ValueType_Bool << 48) + Value;
+    return Result;
 }
 
-static void Write(sl_code *Code, uint8 Val)
+inline sl_value BoxPointer(sl_value_type Type, void *Pointer)
 {
-    if (Code->Size >= Code->Capacity)
-    {
-        if (!Code->Capacity)
-        {
-            Code->Capacity = 4;
-        }
-        else
-        {
-            Code->Capacity *= 2;
-        }
-        uint8 *Data = new uint8[Code->Capacity];
-        if (Code->Data)
-        {
-            memcpy(Data, Code->Data, Code->Size);
-            delete[] Code->Data;
-        }
+#ifdef SL_DEBUG
+    assert(((uintptr_t)Pointer & ~NanBoxPayload) == 0);
+#endif
+    sl_value Result;
+    Result.Bits = NanBoxBase + ((uint64_t)Type << 48) + (uintptr_t)Pointer;
+    return Result;
+}
 
-        Code->Data = Data;
-    }
+#else
 
-    Code->Data[Code->Size++] = Val;
+inline sl_value_type TypeOf(sl_value Value)
+{
+    return Value.Type;
 }
 
-static int Emit(sl_code *Code, sl_opcode OpCode, uint8 Arg = 0)
+inline bool IsType(sl_value Value, sl_value_type Type)
 {
-    Write(Code, (uint8)OpCode);
-    Write(Code, Arg);
-    return Code->Size / 2;
+    return Value.Type == Type;
 }
 
-static void Modify(sl_code *Code, int Index, uint8 Arg)
+inline int64_t AsFixnum(sl_value Value)
 {
-    int ByteIndex = Index*2 + 1;
-    Code->Data[ByteIndex] = Arg;
+    return Value.Fixnum;
 }
 
-static void AddDefOp(sl_script *Script, sl_code *Code, sl_lexer *Lexer, sl_opcode OpCode)
+inline double AsDouble(sl_value Value)
 {
-    int StrIndex = AddString(Script, Lexer->StringVal, Lexer->StringSize);
+    return Value.Double;
+}
+
+inline bool AsBool(sl_value Value)
+{
+    return Value.Bool;
+}
+
+inline void *AsPointer(sl_value Value)
+{
+    return Value.Pointer;
+}
+
+inline sl_value CreateDouble(double Double)
+{
+    sl_value Result;
+    Result.Type = ValueType_Double;
+    Result.Double = Double;
+    return Result;
+}
+
+inline sl_value CreateFixnum(int64_t Fixnum)
+{
+    sl_value Result;
+    Result.Type = ValueType_Fixnum;
+    Result.Fixnum = Fixnum;
+    return Result;
+}
+
+inline sl_value CreateBool(bool Value)
+{
+    sl_value Result;
+    Result.Type = ValueType_Bool;
+    Result.Bool = Value;
+    return Result;
+}
+
+inline sl_value BoxPointer(sl_value_type Type, void *Pointer)
+{
+    sl_value Result;
+    Result.Type = Type;
+    Result.Pointer = Pointer;
+    return Result;
+}
+
+#endif
+
+inline bool IsNumber(sl_value Value)
+{
+    return Is(Value, Fixnum) || Is(Value, Double);
+}
+
+// the value of a fixnum or a double as a double
+inline double AsNumber(sl_value Value)
+{
+    return Is(Value, Fixnum) ? (double)AsFixnum(Value) : AsDouble(Value);
+}
+
+inline sl_string *AsString(sl_value Value)
+{
+    return (sl_string *)AsPointer(Value);
+}
+
+inline sl_func *AsFunc(sl_value Value)
+{
+    return (sl_func *)AsPointer(Value);
+}
+
+inline sl_native *AsNative(sl_value Value)
+{
+    return (sl_native *)AsPointer(Value);
+}
+
+inline sl_coroutine *AsCoroutine(sl_value Value)
+{
+    return (sl_coroutine *)AsPointer(Value);
+}
+
+inline sl_closure *AsClosure(sl_value Value)
+{
+    return (sl_closure *)AsPointer(Value);
+}
+
+inline sl_cell *AsCell(sl_value Value)
+{
+    return (sl_cell *)AsPointer(Value);
+}
+
+inline void *AsCustom(sl_value Value)
+{
+    return AsPointer(Value);
+}
+
+inline sl_value StringValue(sl_string *String)
+{
+    return BoxPointer(ValueType_String, String);
+}
+
+inline sl_value FuncValue(sl_func *Func)
+{
+    return BoxPointer(ValueType_Func, Func);
+}
+
+inline sl_value NativeValue(sl_native *Native)
+{
+    return BoxPointer(ValueType_NativeFunc, Native);
+}
+
+inline sl_value CoroutineValue(sl_coroutine *Co)
+{
+    return BoxPointer(ValueType_Coroutine, Co);
+}
+
+inline sl_value ClosureValue(sl_closure *Closure)
+{
+    return BoxPointer(ValueType_Closure, Closure);
+}
+
+inline sl_value CellValue(sl_cell *Cell)
+{
+    return BoxPointer(ValueType_Cell, Cell);
+}
+
+inline sl_value CreateCustom(void *Custom)
+{
+    return BoxPointer(ValueType_Custom, Custom);
+}
+
+// int64_t arithmetic, false when the result doesn't fit
+inline bool FixnumAdd(int64_t A, int64_t B, int64_t *Result)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return !__builtin_add_overflow(A, B, Result);
+#else
+    if ((B > 0 && A > INT64_MAX - B) || (B < 0 && A < INT64_MIN - B))
+    {
+        return false;
+    }
+    *Result = A + B;
+    return true;
+#endif
+}
+
+inline bool FixnumSub(int64_t A, int64_t B, int64_t *Result)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return !__builtin_sub_overflow(A, B, Result);
+#else
+    if ((B < 0 && A > INT64_MAX + B) || (B > 0 && A < INT64_MIN + B))
+    {
+        return false;
+    }
+    *Result = A - B;
+    return true;
+#endif
+}
+
+inline bool FixnumMul(int64_t A, int64_t B, int64_t *Result)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return !__builtin_mul_overflow(A, B, Result);
+#else
+    if (A > 0 ? (B > 0 ? A > INT64_MAX/B : B < INT64_MIN/A)
+              : (B > 0 ? A < INT64_MIN/B : (A != 0 && B < INT64_MAX/A)))
+    {
+        return false;
+    }
+    *Result = A*B;
+    return true;
+#endif
+}
+
+// Arithmetic on two numbers. Fixnums stay fixnums while the result fits and
+// become doubles when it doesn't or when the other operand is a double.
+inline sl_value NumberAdd(sl_value A, sl_value B)
+{
+    int64_t Result;
+    if (Is(A, Fixnum) && Is(B, Fixnum) && FixnumAdd(AsFixnum(A), AsFixnum(B), &Result))
+    {
+        return CreateFixnum(Result);
+    }
+    return CreateDouble(AsNumber(A) + AsNumber(B));
+}
+
+inline sl_value NumberSub(sl_value A, sl_value B)
+{
+    int64_t Result;
+    if (Is(A, Fixnum) && Is(B, Fixnum) && FixnumSub(AsFixnum(A), AsFixnum(B), &Result))
+    {
+        return CreateFixnum(Result);
+    }
+    return CreateDouble(AsNumber(A) - AsNumber(B));
+}
+
+inline sl_value NumberMul(sl_value A, sl_value B)
+{
+    int64_t Result;
+    if (Is(A, Fixnum) && Is(B, Fixnum) && FixnumMul(AsFixnum(A), AsFixnum(B), &Result))
+    {
+        return CreateFixnum(Result);
+    }
+    return CreateDouble(AsNumber(A) * AsNumber(B));
+}
+
+// dividing fixnums only gives a fixnum when there's no remainder
+inline sl_value NumberDiv(sl_value A, sl_value B)
+{
+    if (Is(A, Fixnum) && Is(B, Fixnum))
+    {
+        int64_t X = AsFixnum(A);
+        int64_t Y = AsFixnum(B);
+        if (Y != 0 && !(Y == -1 && X == INT64_MIN) && X % Y == 0)
+        {
+            return CreateFixnum(X / Y);
+        }
+    }
+    return CreateDouble(AsNumber(A) / AsNumber(B));
+}
+
+inline bool NumberLess(sl_value A, sl_value B)
+{
+    if (Is(A, Fixnum) && Is(B, Fixnum))
+    {
+        return AsFixnum(A) < AsFixnum(B);
+    }
+    return AsNumber(A) < AsNumber(B);
+}
+
+inline bool NumberEqual(sl_value A, sl_value B)
+{
+    if (Is(A, Fixnum) && Is(B, Fixnum))
+    {
+        return AsFixnum(A) == AsFixnum(B);
+    }
+    return AsNumber(A) == AsNumber(B);
+}
+
+// depth of the frame stack, the operand stack starts at InitialStackSize and
+// grows up to StackLimit
+#define MaxFrames 4096
+#define InitialStackSize 1024
+#define StackLimit (1 << 24)
+
+// Frames live on sl_vm::Frames and their locals on the operand stack, right
+// above the callee: the arguments a FuncCall pushed become the first locals.
+// The frame of a coroutine body outlives the call that resumes it, so it goes
+// on the heap along with its locals.
+struct sl_call_frame
+{
+    // Func->LocalCount slots, arguments first
+    sl_value *Vars = NULL;
+
+    // stack slot that gets the result on return, and the first slot of the
+    // frame's operands
+    int Base = 0;
+    int StackBase = 0;
+
+    uint8 *CodePtr = NULL;
+    sl_func *Func = NULL;
+    sl_closure *Closure = NULL;
+    sl_coroutine *Coroutine = NULL;
+    sl_call_frame *Parent = NULL;
+};
+
+enum sl_gc_phase
+{
+    GCPhase_Idle,
+    GCPhase_Mark,
+    GCPhase_Sweep,
+};
+
+// bucket i counts the pauses shorter than 2^i microseconds, the last one
+// also gets everything longer
+#define GCPauseBuckets 20
+
+struct sl_gc_stats
+{
+    uint64_t Pauses[GCPauseBuckets] = {};
+    uint64_t PauseCount = 0;
+    uint64_t Cycles = 0;
+    uint64_t MinorCycles = 0;
+    double TotalPause = 0;
+    double MaxPause = 0;
+};
+
+struct sl_vm
+{
+    // globals are a dense array indexed by the id of their interned name,
+    // GlobalVersion changes whenever the array moves
+    std::vector<sl_string> GlobalNames;
+    sl_intern_table GlobalTable;
+    sl_value *Globals = NULL;
+    int GlobalCount = 0;
+    int GlobalCapacity = 0;
+    uint32 GlobalVersion = 0;
+
+    // Every collectable object. A collection starts when BytesAllocated
+    // would go past NextCollection, which is then set to GCGrowth times the
+    // bytes that survived, or GCMinHeap if that's larger. Collections are
+    // incremental, each allocation while one is running traces or sweeps
+    // GCStepWork objects.
+    sl_object *Objects = NULL;
+    size_t BytesAllocated = 0;
+    size_t NextCollection = 0;
+    float GCGrowth = 2.0f;
+    size_t GCMinHeap = 1 << 20;
+    int GCStepWork = 256;
+    sl_gc_phase GCPhase = GCPhase_Idle;
+    std::vector<sl_object *> Gray;
+    sl_object *SweepList = NULL;
+    sl_gc_stats GCStats;
+
+    // Strings made by natives and closures are bump allocated here and only
+    // copied to the pools if they're still alive when it fills up, see
+    // MinorCollect. Set NurserySize before InitVM, 0 turns it off.
+    char *Nursery = NULL;
+    size_t NurserySize = 256 << 10;
+    size_t NurseryTop = 0;
+    std::vector<sl_object *> Remembered;
+    std::vector<sl_object *> Promoted;
+
+    sl_pool StringPool;
+    sl_pool CoroutinePool;
+    sl_pool ClosurePool;
+    sl_pool NativePool;
+    sl_pool CellPool;
+    sl_value *Stack = NULL;
+    int StackTop = 0;
+    int StackSize = 0;
+    sl_call_frame *Frames = NULL;
+    int FrameTop = 0;
+    sl_call_frame *CurrentFrame = NULL;
+    sl_script *CurrentScript = NULL;
+
+    // the fixnum operands of the register operators, see RegImmediate
+    sl_value RegisterImmediates[RegBranch - RegImmediate];
+
+#ifdef SL_PROFILE_OPCODES
+    // how many times each opcode ran right after another, see
+    // PrintOpCodeProfile
+    uint64_t OpCodePairs[OpCodeCount][OpCodeCount] = {};
+    int LastOpCode = OpCode_Halt;
+#endif
+};
+
+static sl_node *ParseExpr(sl_script *Script, sl_arena *Arena, sl_lexer *Lexer);
+static int GenExpr(sl_script *Script, sl_scope *Scope, sl_node *Node, sl_value_use Use = ValueUse_Push);
+
+static void ParseSymbol(sl_lexer *Lexer)
+{
+    const char *Beg = Lexer->Ptr;
+    while (IsSymbol(*Lexer->Ptr) || IsDigit(*Lexer->Ptr))
+    {
+        Lexer->Ptr++;
+    }
+
+    Lexer->StringVal = Beg;
+    Lexer->StringSize = Lexer->Ptr - Beg;
+}
+
+inline bool TokenIs(sl_lexer *Lexer, const char *Str, int Size)
+{
+    return Lexer->StringSize == Size && memcmp(Lexer->StringVal, Str, Size) == 0;
+}
+
+#define TOKEN_IS(Lexer, Literal) TokenIs(Lexer, Literal, sizeof(Literal) - 1)
+
+static void NextToken(sl_lexer *Lexer)
+{
+    while (*Lexer->Ptr == ' ' ||
+           *Lexer->Ptr == '\n' ||
+           *Lexer->Ptr == '\t')
+    {
+        Lexer->Ptr++;
+    }
+
+    if (!(*Lexer->Ptr))
+    {
+        Lexer->TokenType = TokenType_EOF;
+        return;
+    }
+
+    switch (*Lexer->Ptr)
+    {
+    case '(':
+        Lexer->TokenType = TokenType_LeftParen;
+        Lexer->Ptr++;
+        break;
+
+    case ')':
+        Lexer->TokenType = TokenType_RightParen;
+        Lexer->Ptr++;
+        break;
+
+    case '[':
+        Lexer->TokenType = TokenType_LeftBracket;
+        Lexer->Ptr++;
+        break;
+
+    case ']':
+        Lexer->TokenType = TokenType_RightBracket;
+        Lexer->Ptr++;
+        break;
+
+    case '#':
+        Lexer->TokenType = TokenType_Hash;
+        Lexer->Ptr++;
+        break;
+
+    case '"':
+    {
+        Lexer->TokenType = TokenType_String;
+        Lexer->Ptr++;
+
+        const char *Beg = Lexer->Ptr;
+        while (*Lexer->Ptr != '"')
+        {
+            Lexer->Ptr++;
+        }
+
+        Lexer->StringVal = Beg;
+        Lexer->StringSize = Lexer->Ptr - Beg;
+
+        Lexer->Ptr++;
+        break;
+    }
+
+    case '\'':
+    {
+        Lexer->TokenType = TokenType_String;
+        Lexer->Ptr++;
+
+        if (IsSymbol(*Lexer->Ptr))
+        {
+            ParseSymbol(Lexer);
+        }
+        else
+        {
+            Lexer->StringVal = Lexer->Ptr;
+            Lexer->StringSize = 0;
+        }
+        break;
+    }
+
+    default:
+        if (IsDigit(*Lexer->Ptr))
+        {
+            // only digits make a fixnum, unless it doesn't fit in one
+            const char *Beg = Lexer->Ptr;
+            bool IsFixnum = true;
+            int64_t Fixnum = 0;
+            while (IsDigit(*Lexer->Ptr) || *Lexer->Ptr == '.')
+            {
+                int Digit = *Lexer->Ptr - '0';
+                if (*Lexer->Ptr == '.' || Fixnum > (INT64_MAX - Digit)/10)
+                {
+                    IsFixnum = false;
+                }
+                else
+                {
+                    Fixnum = Fixnum*10 + Digit;
+                }
+                Lexer->Ptr++;
+            }
+
+            if (IsFixnum)
+            {
+                Lexer->TokenType = TokenType_Fixnum;
+                Lexer->FixnumVal = Fixnum;
+                break;
+            }
+
+            // strtod needs a terminated string, but the source buffer goes on
+            char Str[64];
+            int Size = Lexer->Ptr - Beg;
+            if (Size >= (int)sizeof(Str))
+            {
+                Size = sizeof(Str) - 1;
+            }
+            memcpy(Str, Beg, Size);
+            Str[Size] = '\0';
+
+            Lexer->TokenType = TokenType_Number;
+            Lexer->NumberVal = strtod(Str, NULL);
+        }
+        else if (IsSymbol(*Lexer->Ptr))
+        {
+            Lexer->TokenType = TokenType_Symbol;
+            ParseSymbol(Lexer);
+        }
+        break;
+    }
+}
+
+static void InitLexer(sl_lexer *Lexer, const char *Source)
+{
+    Lexer->Source = Source;
+    Lexer->Ptr = Source;
+    Lexer->StringVal = NULL;
+    NextToken(Lexer);
+}
+
+inline uint32 HashBytes(const char *Data, int Size)
+{
+    // FNV-1a
+    uint32 Hash = 2166136261u;
+    for (int i = 0; i < Size; i++)
+    {
+        Hash ^= (uint8)Data[i];
+        Hash *= 16777619u;
+    }
+    return Hash;
+}
+
+inline uint32 HashNumber(double Value)
+{
+    if (Value == 0)
+    {
+        // -0 and 0 compare equal so they must hash equal
+        Value = 0;
+    }
+    return HashBytes((const char *)&Value, sizeof(Value));
+}
+
+static void InsertIntern(sl_intern_table *Table, uint32 Hash, int Index)
+{
+    if ((Table->Count + 1)*2 > Table->Capacity)
+    {
+        int OldCapacity = Table->Capacity;
+        sl_intern_slot *OldSlots = Table->Slots;
+
+        Table->Capacity = OldCapacity ? OldCapacity*2 : 64;
+        Table->Slots = new sl_intern_slot[Table->Capacity];
+        for (int i = 0; i < Table->Capacity; i++)
+        {
+            Table->Slots[i].Index = -1;
+        }
+
+        Table->Count = 0;
+        for (int i = 0; i < OldCapacity; i++)
+        {
+            if (OldSlots[i].Index >= 0)
+            {
+                InsertIntern(Table, OldSlots[i].Hash, OldSlots[i].Index);
+            }
+        }
+        delete[] OldSlots;
+    }
+
+    uint32 Mask = Table->Capacity - 1;
+    uint32 Pos = Hash & Mask;
+    while (Table->Slots[Pos].Index >= 0)
+    {
+        Pos = (Pos + 1) & Mask;
+    }
+    Table->Slots[Pos].Hash = Hash;
+    Table->Slots[Pos].Index = Index;
+    Table->Count++;
+}
+
+static int InternString(std::vector<sl_string> &Strings, sl_intern_table *Table,
+                        const char *Value, int Size)
+{
+    // @TODO: use arena for allocation
+    uint32 Hash = HashBytes(Value, Size);
+    if (Table->Capacity)
+    {
+        uint32 Mask = Table->Capacity - 1;
+        for (uint32 Pos = Hash & Mask; Table->Slots[Pos].Index >= 0; Pos = (Pos + 1) & Mask)
+        {
+            auto &Slot = Table->Slots[Pos];
+            if (Slot.Hash == Hash)
+            {
+                auto &Str = Strings[Slot.Index];
+                if (Str.Size == Size && memcmp(Value, Str.Value, Size) == 0)
+                {
+                    return Slot.Index;
+                }
+            }
+        }
+    }
+
+    sl_string Str;
+    Str.Size = Size;
+    Str.Hash = Hash;
+    Str.Value = new char[Size+1];
+    memcpy(Str.Value, Value, Size);
+    Str.Value[Size] = '\0';
+
+    Strings.push_back(Str);
+    int Index = Strings.size() - 1;
+    InsertIntern(Table, Hash, Index);
+    return Index;
+}
+
+static int AddString(sl_script *Script, const char *Value, int Size)
+{
+    return InternString(Script->Strings, &Script->StringTable, Value, Size);
+}
+
+// every global access gets its own site so each caches its slot separately
+static int AddGlobalSite(sl_script *Script, int StringIndex)
+{
+    sl_global_site Site;
+    Site.StringIndex = StringIndex;
+    Script->GlobalSites.push_back(Site);
+    return Script->GlobalSites.size() - 1;
+}
+
+static int AddNumber(sl_script *Script, double Value)
+{
+    sl_intern_table *Table = &Script->NumberTable;
+    uint32 Hash = HashNumber(Value);
+    if (Table->Capacity)
+    {
+        uint32 Mask = Table->Capacity - 1;
+        for (uint32 Pos = Hash & Mask; Table->Slots[Pos].Index >= 0; Pos = (Pos + 1) & Mask)
+        {
+            auto &Slot = Table->Slots[Pos];
+            if (Slot.Hash == Hash && Script->Numbers[Slot.Index] == Value)
+            {
+                return Slot.Index;
+            }
+        }
+    }
+
+    if (Script->NumberCount >= Script->NumberCapacity)
+    {
+        Script->NumberCapacity = Script->NumberCapacity ? Script->NumberCapacity*2 : 16;
+        double *Numbers = new double[Script->NumberCapacity];
+        if (Script->Numbers)
+        {
+            memcpy(Numbers, Script->Numbers, Script->NumberCount*sizeof(double));
+            delete[] Script->Numbers;
+        }
+        Script->Numbers = Numbers;
+    }
+
+    int Index = Script->NumberCount++;
+    Script->Numbers[Index] = Value;
+    InsertIntern(Table, Hash, Index);
+    return Index;
+}
+
+static int AddFixnum(sl_script *Script, int64_t Value)
+{
+    sl_intern_table *Table = &Script->FixnumTable;
+    uint32 Hash = HashBytes((const char *)&Value, sizeof(Value));
+    if (Table->Capacity)
+    {
+        uint32 Mask = Table->Capacity - 1;
+        for (uint32 Pos = Hash & Mask; Table->Slots[Pos].Index >= 0; Pos = (Pos + 1) & Mask)
+        {
+            auto &Slot = Table->Slots[Pos];
+            if (Slot.Hash == Hash && Script->Fixnums[Slot.Index] == Value)
+            {
+                return Slot.Index;
+            }
+        }
+    }
+
+    if (Script->FixnumCount >= Script->FixnumCapacity)
+    {
+        Script->FixnumCapacity = Script->FixnumCapacity ? Script->FixnumCapacity*2 : 16;
+        int64_t *Fixnums = new int64_t[Script->FixnumCapacity];
+        if (Script->Fixnums)
+        {
+            memcpy(Fixnums, Script->Fixnums, Script->FixnumCount*sizeof(int64_t));
+            delete[] Script->Fixnums;
+        }
+        Script->Fixnums = Fixnums;
+    }
+
+    int Index = Script->FixnumCount++;
+    Script->Fixnums[Index] = Value;
+    InsertIntern(Table, Hash, Index);
+    return Index;
+}
+
+static void Write(sl_code *Code, uint8 Val)
+{
+    if (Code->Size >= Code->Capacity)
+    {
+        if (!Code->Capacity)
+        {
+            Code->Capacity = 4;
+        }
+        else
+        {
+            Code->Capacity *= 2;
+        }
+        uint8 *Data = new uint8[Code->Capacity];
+        if (Code->Data)
+        {
+            memcpy(Data, Code->Data, Code->Size);
+            delete[] Code->Data;
+        }
+
+        Code->Data = Data;
+    }
+
+    Code->Data[Code->Size++] = Val;
+}
+
+// Instructions are an opcode byte followed by an operand byte. Operands that
+// don't fit are encoded as 'Wide, opcode, 4 byte operand' so the common case
+// stays two bytes. Returns the offset of the instruction.
+static int Emit(sl_code *Code, sl_opcode OpCode, uint32 Arg = 0, bool ForceWide = false)
+{
+    int Offset = Code->Size;
+    if (Arg > 0xFF || ForceWide)
+    {
+        Write(Code, (uint8)OpCode_Wide);
+        Write(Code, (uint8)OpCode);
+        for (int i = 0; i < 4; i++)
+        {
+            Write(Code, (uint8)(Arg >> (i*8)));
+        }
+    }
+    else
+    {
+        Write(Code, (uint8)OpCode);
+        Write(Code, (uint8)Arg);
+    }
+    return Offset;
+}
+
+static void Modify(sl_code *Code, int Offset, uint32 Arg)
+{
+    uint8 *Ptr = Code->Data + Offset;
+    if (*Ptr == OpCode_Wide)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            Ptr[2 + i] = (uint8)(Arg >> (i*8));
+        }
+    }
+    else
+    {
+        assert(Arg <= 0xFF);
+        Ptr[1] = (uint8)Arg;
+    }
+}
+
+inline sl_opcode Decode(uint8 *&Ptr, uint32 *Arg)
+{
+    sl_opcode OpCode = (sl_opcode)*Ptr++;
+    *Arg = *Ptr++;
+    if (OpCode == OpCode_Wide)
+    {
+        OpCode = (sl_opcode)*Arg;
+        *Arg = (uint32)Ptr[0] | ((uint32)Ptr[1] << 8) | ((uint32)Ptr[2] << 16) | ((uint32)Ptr[3] << 24);
+        Ptr += 4;
+    }
+    return OpCode;
+}
+
+// Declared false only reserves the slot, the function's own code can't see
+// it yet
+static int DeclareLocal(sl_scope *Scope, int Name, bool Declared = true)
+{
+    for (int i = 0; i < Scope->Locals.size(); i++)
+    {
+        if (Scope->Locals[i] == Name)
+        {
+            if (Declared)
+            {
+                Scope->Declared[i] = true;
+            }
+            return i;
+        }
+    }
+    Scope->Locals.push_back(Name);
+    Scope->Declared.push_back(Declared);
+    Scope->Boxed.push_back(false);
+    return Scope->Locals.size() - 1;
+}
+
+// Locals of enclosing functions are captured by sharing their cell, see
+// sl_cell. A function's own code only sees a local from its definition on,
+// the Nested lookups of the functions inside it see every local so they can
+// refer to ones defined later in the body.
+static sl_var ResolveSymbol(sl_scope *Scope, int Name, bool Nested = false)
+{
+    sl_var Result;
+    Result.Type = VarType_Global;
+    Result.Index = Name;
+    if (!Scope->Func)
+    {
+        return Result;
+    }
+
+    for (int i = 0; i < Scope->Locals.size(); i++)
+    {
+        if (Scope->Locals[i] == Name && (Nested || Scope->Declared[i]))
+        {
+            Result.Type = VarType_Local;
+            Result.Index = i;
+            return Result;
+        }
+    }
+
+    if (Name == Scope->SelfName)
+    {
+        Result.Type = VarType_Self;
+        Result.Index = 0;
+        return Result;
+    }
+
+    for (int i = 0; i < Scope->Captures.size(); i++)
+    {
+        if (Scope->Captures[i] == Name)
+        {
+            Result.Type = VarType_Upvalue;
+            Result.Index = i;
+            return Result;
+        }
+    }
+
+    sl_var Outer = ResolveSymbol(Scope->Parent, Name, true);
+    if (Outer.Type == VarType_Global)
+    {
+        return Outer;
+    }
+
+    // GenFunc gives a function a local for its name when nested ones use it
+    assert(Outer.Type != VarType_Self);
+
+    sl_capture Capture;
+    Capture.Type = Outer.Type;
+    Capture.Index = Outer.Index;
+    Scope->Func->Captures.push_back(Capture);
+    Scope->Captures.push_back(Name);
+
+    Result.Type = VarType_Upvalue;
+    Result.Index = Scope->Captures.size() - 1;
+    return Result;
+}
+
+static void EmitLoad(sl_script *Script, sl_scope *Scope, sl_var Var)
+{
+    switch (Var.Type)
+    {
+    case VarType_Global:
+        Emit(Scope->Code, OpCode_LoadGlobal, AddGlobalSite(Script, Var.Index));
+        break;
+
+    case VarType_Local:
+        Emit(Scope->Code, Scope->Boxed[Var.Index] ? OpCode_LoadCell : OpCode_LoadLocal, Var.Index);
+        break;
+
+    case VarType_Upvalue:
+        Emit(Scope->Code, OpCode_LoadUpvalue, Var.Index);
+        break;
+
+    case VarType_Self:
+        Emit(Scope->Code, OpCode_LoadSelf);
+        break;
+    }
+}
+
+static void EmitStore(sl_script *Script, sl_scope *Scope, sl_var Var, bool Once = false)
+{
+    switch (Var.Type)
+    {
+    case VarType_Global:
+        Emit(Scope->Code, Once ? OpCode_DefonceGlobal : OpCode_StoreGlobal, AddGlobalSite(Script, Var.Index));
+        break;
+
+    case VarType_Local:
+        if (Scope->Boxed[Var.Index])
+        {
+            Emit(Scope->Code, Once ? OpCode_DefonceCell : OpCode_StoreCell, Var.Index);
+        }
+        else
+        {
+            Emit(Scope->Code, Once ? OpCode_DefonceLocal : OpCode_StoreLocal, Var.Index);
+        }
+        break;
+
+    case VarType_Upvalue:
+        Emit(Scope->Code, OpCode_StoreUpvalue, Var.Index);
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void *ArenaAlloc(sl_arena *Arena, size_t Size)
+{
+    Size = (Size + 7) & ~(size_t)7;
+    if (!Arena->Current || Arena->Used + Size > ArenaBlockSize)
+    {
+        // blocks kept by ResetArena are reused before new ones are made
+        sl_arena_block *Block = Arena->Current ? Arena->Current->Next : Arena->First;
+        if (!Block)
+        {
+            Block = (sl_arena_block *)malloc(sizeof(sl_arena_block) + ArenaBlockSize);
+            Block->Next = NULL;
+            if (Arena->Current)
+            {
+                Arena->Current->Next = Block;
+            }
+            else
+            {
+                Arena->First = Block;
+            }
+        }
+        Arena->Current = Block;
+        Arena->Used = 0;
+    }
+
+    void *Result = (char *)(Arena->Current + 1) + Arena->Used;
+    Arena->Used += Size;
+    return Result;
+}
+
+static void ResetArena(sl_arena *Arena)
+{
+    Arena->Current = Arena->First;
+    Arena->Used = 0;
+}
+
+static void FreeArena(sl_arena *Arena)
+{
+    while (Arena->First)
+    {
+        sl_arena_block *Next = Arena->First->Next;
+        free(Arena->First);
+        Arena->First = Next;
+    }
+    Arena->Current = NULL;
+    Arena->Used = 0;
+}
+
+static sl_node *NewNode(sl_arena *Arena, sl_node_type Type)
+{
+    sl_node *Node = (sl_node *)ArenaAlloc(Arena, sizeof(sl_node));
+    Node->Type = Type;
+    Node->Name = -1;
+    Node->Children = NULL;
+    Node->Next = NULL;
+    Node->Count = 0;
+    Node->Fixnum = 0;
+    return Node;
+}
+
+// links Child after the one Tail points to, returns the new tail
+inline sl_node **AppendChild(sl_node *Node, sl_node **Tail, sl_node *Child)
+{
+    *Tail = Child;
+    Node->Count++;
+    return &Child->Next;
+}
+
+// moves Lexer past the closing paren of the current list
+static void SkipList(sl_lexer *Lexer)
+{
+    int Depth = 0;
+    while (Lexer->TokenType != TokenType_EOF)
+    {
+        if (Lexer->TokenType == TokenType_LeftParen)
+        {
+            Depth++;
+        }
+        else if (Lexer->TokenType == TokenType_RightParen && Depth-- == 0)
+        {
+            NextToken(Lexer);
+            return;
+        }
+        NextToken(Lexer);
+    }
+}
+
+// operators compiled to their own opcode, OpCode_Halt if Lexer is not one
+static sl_opcode OperatorOpCode(sl_lexer *Lexer)
+{
+    if (TOKEN_IS(Lexer, "+")) return OpCode_Add;
+    if (TOKEN_IS(Lexer, "-")) return OpCode_Sub;
+    if (TOKEN_IS(Lexer, "*")) return OpCode_Mul;
+    if (TOKEN_IS(Lexer, "/")) return OpCode_Div;
+    if (TOKEN_IS(Lexer, "<")) return OpCode_Lt;
+    if (TOKEN_IS(Lexer, ">")) return OpCode_Gt;
+    if (TOKEN_IS(Lexer, "=")) return OpCode_Eq;
+    return OpCode_Halt;
+}
+
+static sl_node *ParseDef(sl_script *Script, sl_arena *Arena, sl_lexer *Lexer, sl_def_type DefType)
+{
+    NextToken(Lexer);
+    if (Lexer->TokenType != TokenType_Symbol)
+    {
+        printf("error: %s expecting symbol\n", DefType == DefType_Defonce ? "defonce" : "def");
+        SkipList(Lexer);
+        return NewNode(Arena, NodeType_Nil);
+    }
+
+    sl_node *Node = NewNode(Arena, NodeType_Def);
+    Node->DefType = DefType;
+    Node->Name = AddString(Script, Lexer->StringVal, Lexer->StringSize);
+    NextToken(Lexer);
+    AppendChild(Node, &Node->Children, ParseExpr(Script, Arena, Lexer));
+    SkipList(Lexer);
+    return Node;
+}
+
+static sl_node *ParseDefun(sl_script *Script, sl_arena *Arena, sl_lexer *Lexer)
+{
+    NextToken(Lexer);
+    if (Lexer->TokenType != TokenType_Symbol)
+    {
+        printf("error: defun expecting symbol\n");
+        SkipList(Lexer);
+        return NewNode(Arena, NodeType_Nil);
+    }
+
+    sl_node *Node = NewNode(Arena, NodeType_Defun);
+    Node->Name = AddString(Script, Lexer->StringVal, Lexer->StringSize);
+    Node->ArgCount = 0;
+    sl_node **Tail = &Node->Children;
+    NextToken(Lexer);
+
+    if (Lexer->TokenType != TokenType_LeftBracket)
+    {
+        printf("error: function '%s': expecting function arguments\n",
+               Script->Strings[Node->Name].Value);
+    }
+    else
+    {
+        NextToken(Lexer);
+        while (Lexer->TokenType == TokenType_Symbol)
+        {
+            sl_node *Arg = NewNode(Arena, NodeType_Symbol);
+            Arg->Name = AddString(Script, Lexer->StringVal, Lexer->StringSize);
+            Tail = AppendChild(Node, Tail, Arg);
+            Node->ArgCount++;
+            NextToken(Lexer);
+        }
+
+        if (Lexer->TokenType != TokenType_RightBracket)
+        {
+            printf("error: function '%s': expecting ']' to close arguments\n",
+                   Script->Strings[Node->Name].Value);
+        }
+        NextToken(Lexer);
+    }
+
+    while (Lexer->TokenType != TokenType_RightParen && Lexer->TokenType != TokenType_EOF)
+    {
+        Tail = AppendChild(Node, Tail, ParseExpr(Script, Arena, Lexer));
+    }
+    NextToken(Lexer);
+    return Node;
+}
+
+// (if test then [else]), (when test then) and (cond test branch ...) all
+// become a Cond
+static sl_node *ParseConditional(sl_script *Script, sl_arena *Arena, sl_lexer *Lexer, bool IsCond, bool HasElse)
+{
+    sl_node *Node = NewNode(Arena, NodeType_Cond);
+    sl_node **Tail = &Node->Children;
     NextToken(Lexer);
-    ParseExpr(Script, Code, Lexer);
+
+    do
+    {
+        if (Lexer->TokenType == TokenType_RightParen || Lexer->TokenType == TokenType_EOF)
+        {
+            break;
+        }
+        Tail = AppendChild(Node, Tail, ParseExpr(Script, Arena, Lexer));
+
+        if (Lexer->TokenType == TokenType_RightParen)
+        {
+            printf("error: expecting a branch after the test\n");
+            Tail = AppendChild(Node, Tail, NewNode(Arena, NodeType_Nil));
+        }
+        else
+        {
+            Tail = AppendChild(Node, Tail, ParseExpr(Script, Arena, Lexer));
+        }
+    } while (IsCond);
+
+    if (HasElse && Lexer->TokenType != TokenType_RightParen && Lexer->TokenType != TokenType_EOF)
+    {
+        Tail = AppendChild(Node, Tail, ParseExpr(Script, Arena, Lexer));
+    }
+
+    if (Lexer->TokenType != TokenType_RightParen)
+    {
+        printf("error: too many branches\n");
+    }
+    SkipList(Lexer);
+    return Node;
+}
+
+// the list after its '(', NULL when it doesn't start with a reserved word
+static sl_node *ParseReserved(sl_script *Script, sl_arena *Arena, sl_lexer *Lexer)
+{
+    switch (Lexer->StringSize)
+    {
+    case 7:
+        if (TOKEN_IS(Lexer, "defonce")) return ParseDef(Script, Arena, Lexer, DefType_Defonce);
+        break;
+
+    case 5:
+        if (TOKEN_IS(Lexer, "defun")) return ParseDefun(Script, Arena, Lexer);
+        break;
+
+    case 4:
+        if (TOKEN_IS(Lexer, "cond")) return ParseConditional(Script, Arena, Lexer, true, false);
+        if (TOKEN_IS(Lexer, "when")) return ParseConditional(Script, Arena, Lexer, false, false);
+        break;
+
+    case 3:
+        if (TOKEN_IS(Lexer, "def")) return ParseDef(Script, Arena, Lexer, DefType_Def);
+        if (TOKEN_IS(Lexer, "set")) return ParseDef(Script, Arena, Lexer, DefType_Set);
+        break;
+
+    case 2:
+        if (TOKEN_IS(Lexer, "if")) return ParseConditional(Script, Arena, Lexer, false, true);
+        break;
+    }
+
+    return NULL;
+}
+
+// Parses one expression. Strings and symbols are interned here, numbers are
+// kept in the node until GenExpr adds them. Anything that can't start an
+// expression gives a Nil, and a ')' is left for the list it closes.
+static sl_node *ParseExpr(sl_script *Script, sl_arena *Arena, sl_lexer *Lexer)
+{
+    sl_node *Node;
+    switch (Lexer->TokenType)
+    {
+    case TokenType_LeftParen:
+    {
+        NextToken(Lexer);
+        sl_opcode OpCode = OpCode_Halt;
+        if (Lexer->TokenType == TokenType_Symbol)
+        {
+            Node = ParseReserved(Script, Arena, Lexer);
+            if (Node)
+            {
+                return Node;
+            }
+            OpCode = OperatorOpCode(Lexer);
+        }
+
+        Node = NewNode(Arena, NodeType_Call);
+        Node->OpCode = OpCode;
+        sl_node **Tail = &Node->Children;
+        while (Lexer->TokenType != TokenType_RightParen && Lexer->TokenType != TokenType_EOF)
+        {
+            Tail = AppendChild(Node, Tail, ParseExpr(Script, Arena, Lexer));
+        }
+        NextToken(Lexer);
+
+        if (!Node->Count)
+        {
+            Node->Type = NodeType_Nil;
+        }
+        return Node;
+    }
+
+    case TokenType_Hash:
+        NextToken(Lexer);
+        Node = NewNode(Arena, NodeType_Lambda);
+        AppendChild(Node, &Node->Children, ParseExpr(Script, Arena, Lexer));
+        return Node;
+
+    case TokenType_String:
+        Node = NewNode(Arena, NodeType_String);
+        Node->Name = AddString(Script, Lexer->StringVal, Lexer->StringSize);
+        break;
+
+    case TokenType_Number:
+        Node = NewNode(Arena, NodeType_Number);
+        Node->Number = Lexer->NumberVal;
+        break;
+
+    case TokenType_Fixnum:
+        Node = NewNode(Arena, NodeType_Fixnum);
+        Node->Fixnum = Lexer->FixnumVal;
+        break;
+
+    case TokenType_Symbol:
+        if (TOKEN_IS(Lexer, "true") || TOKEN_IS(Lexer, "false"))
+        {
+            Node = NewNode(Arena, NodeType_Bool);
+            Node->Bool = TOKEN_IS(Lexer, "true");
+        }
+        else
+        {
+            Node = NewNode(Arena, NodeType_Symbol);
+            Node->Name = AddString(Script, Lexer->StringVal, Lexer->StringSize);
+        }
+        break;
+
+    case TokenType_RightBracket:
+        Node = NewNode(Arena, NodeType_Nil);
+        break;
+
+    default:
+        return NewNode(Arena, NodeType_Nil);
+    }
+
     NextToken(Lexer);
-    Emit(Code, OpCode, (uint8)StrIndex);
+    return Node;
+}
+
+static void GenDef(sl_script *Script, sl_scope *Scope, sl_node *Node)
+{
+    // the value is compiled before the name is declared, so '(def x (+ x 1))'
+    // still sees the outer x
+    int Dst = GenExpr(Script, Scope, Node->Children);
+
+    sl_var Var;
+    if (Node->DefType == DefType_Set)
+    {
+        Var = ResolveSymbol(Scope, Node->Name);
+    }
+    else if (Scope->Func)
+    {
+        Var.Type = VarType_Local;
+        Var.Index = DeclareLocal(Scope, Node->Name);
+    }
+    else
+    {
+        Var.Type = VarType_Global;
+        Var.Index = Node->Name;
+    }
+
+    // a register operator writes the local itself, the StoreLocal is only run
+    // by its generic call
+    if (Dst >= 0 && Var.Type == VarType_Local && Node->DefType != DefType_Defonce &&
+        Var.Index < RegImmediate && !Scope->Boxed[Var.Index])
+    {
+        Scope->Code->Data[Dst] = (uint8)Var.Index;
+    }
+
+    EmitStore(Script, Scope, Var, Node->DefType == DefType_Defonce);
+}
+
+inline bool Contains(std::vector<int> &Names, int Name)
+{
+    return std::find(Names.begin(), Names.end(), Name) != Names.end();
+}
+
+// every name Node refers to or sets
+static void CollectNames(sl_node *Node, std::vector<int> *Names)
+{
+    if (Node->Type == NodeType_Symbol || (Node->Type == NodeType_Def && Node->DefType == DefType_Set))
+    {
+        Names->push_back(Node->Name);
+    }
+    if (Node->Type != NodeType_Defun)
+    {
+        for (sl_node *Child = Node->Children; Child; Child = Child->Next)
+        {
+            CollectNames(Child, Names);
+        }
+        return;
+    }
+
+    // the arguments of a defun and its own name shadow the outer ones in it
+    std::vector<int> Shadowed(1, Node->Name);
+    sl_node *Child = Node->Children;
+    for (int i = 0; i < Node->ArgCount; i++, Child = Child->Next)
+    {
+        Shadowed.push_back(Child->Name);
+    }
+    std::vector<int> Inner;
+    for (; Child; Child = Child->Next)
+    {
+        CollectNames(Child, &Inner);
+    }
+    for (int Name : Inner)
+    {
+        if (!Contains(Shadowed, Name))
+        {
+            Names->push_back(Name);
+        }
+    }
+}
+
+// Walks the part of a function body compiled into its own code, # branches
+// included. The names it defines go to Defined, the ones it sets to Assigned
+// and the names the functions created in it use to Nested.
+static void ScanBody(sl_node *Node, std::vector<int> *Defined, std::vector<int> *Assigned,
+                     std::vector<int> *Nested)
+{
+    switch (Node->Type)
+    {
+    case NodeType_Lambda:
+        CollectNames(Node, Nested);
+        return;
+
+    case NodeType_Defun:
+        Defined->push_back(Node->Name);
+        CollectNames(Node, Nested);
+        return;
+
+    case NodeType_Def:
+        (Node->DefType == DefType_Set ? Assigned : Defined)->push_back(Node->Name);
+        break;
+
+    case NodeType_Cond:
+    {
+        int i = 0;
+        for (sl_node *Child = Node->Children; Child; Child = Child->Next, i++)
+        {
+            bool Branch = i % 2 == 1 || (!Child->Next && Node->Count % 2 == 1);
+            ScanBody(Branch && Child->Type == NodeType_Lambda ? Child->Children : Child,
+                     Defined, Assigned, Nested);
+        }
+        return;
+    }
+
+    default:
+        break;
+    }
+
+    for (sl_node *Child = Node->Children; Child; Child = Child->Next)
+    {
+        ScanBody(Child, Defined, Assigned, Nested);
+    }
+}
+
+// compiles Body into a new function and loads it, the first ArgCount nodes of
+// Body are the argument symbols, SelfName is -1 for a lambda
+static void GenFunc(sl_script *Script, sl_scope *Scope, sl_node *Body, int StringIndex, int SelfName, int ArgCount)
+{
+    sl_func *Func = new sl_func;
+    Func->StringIndex = StringIndex;
+
+    sl_scope FuncScope;
+    FuncScope.Parent = Scope;
+    FuncScope.Func = Func;
+    FuncScope.Code = &Func->Code;
+    FuncScope.SelfName = SelfName;
+
+    for (int i = 0; i < ArgCount; i++, Body = Body->Next)
+    {
+        DeclareLocal(&FuncScope, Body->Name);
+    }
+    Func->ArgCount = FuncScope.Locals.size();
+
+    std::vector<int> Defined;
+    std::vector<int> Assigned;
+    std::vector<int> Nested;
+    for (sl_node *Node = Body; Node; Node = Node->Next)
+    {
+        ScanBody(Node, &Defined, &Assigned, &Nested);
+    }
+
+    // a defun that sets its name or whose nested functions use it keeps
+    // itself in a local, it's a plain variable from then on
+    if (SelfName >= 0 && !Contains(FuncScope.Locals, SelfName) &&
+        (Contains(Assigned, SelfName) || Contains(Nested, SelfName)))
+    {
+        Emit(FuncScope.Code, OpCode_LoadSelf);
+        Emit(FuncScope.Code, OpCode_StoreLocal, DeclareLocal(&FuncScope, SelfName));
+    }
+
+    // the slots of everything the body defines exist before its code, so the
+    // functions created before a definition share the slot too. Those that
+    // nested functions use are boxed in cells right away.
+    for (int Name : Defined)
+    {
+        DeclareLocal(&FuncScope, Name, false);
+    }
+    for (int i = 0; i < FuncScope.Locals.size(); i++)
+    {
+        if (Contains(Nested, FuncScope.Locals[i]))
+        {
+            FuncScope.Boxed[i] = true;
+            Emit(FuncScope.Code, OpCode_MakeCell, i);
+        }
+    }
+
+    // the value of the last statement is what Return takes
+    if (!Body)
+    {
+        Emit(FuncScope.Code, OpCode_LoadNil);
+    }
+    for (; Body; Body = Body->Next)
+    {
+        GenExpr(Script, &FuncScope, Body, Body->Next ? ValueUse_Pop : ValueUse_Tail);
+    }
+    Emit(FuncScope.Code, OpCode_Return);
+    Func->LocalCount = FuncScope.Locals.size();
+
+    Script->Funcs.push_back(Func);
+    Emit(Scope->Code, OpCode_LoadFunc, Script->Funcs.size() - 1);
+}
+
+static void GenDefun(sl_script *Script, sl_scope *Scope, sl_node *Node)
+{
+    GenFunc(Script, Scope, Node->Children, Node->Name, Node->Name, Node->ArgCount);
+
+    sl_var Var;
+    Var.Type = Scope->Func ? VarType_Local : VarType_Global;
+    Var.Index = Scope->Func ? DeclareLocal(Scope, Node->Name) : Node->Name;
+    EmitStore(Script, Scope, Var);
+}
+
+// the register Node can be read from in place, a local or a small fixnum,
+// RegStack if it has to be compiled
+static uint8 RegisterOperand(sl_scope *Scope, sl_node *Node)
+{
+    if (Node->Type == NodeType_Fixnum &&
+        Node->Fixnum >= RegImmediateMin && Node->Fixnum <= RegImmediateMax)
+    {
+        return (uint8)(Node->Fixnum + RegImmediateBias);
+    }
+    if (Node->Type == NodeType_Symbol && Scope->Func)
+    {
+        sl_var Var = ResolveSymbol(Scope, Node->Name);
+        if (Var.Type == VarType_Local && Var.Index < RegImmediate && !Scope->Boxed[Var.Index])
+        {
+            return (uint8)Var.Index;
+        }
+    }
+    return RegStack;
+}
+
+// (op a b) where op is a global, the opcode falls back to calling it if it's
+// been redefined. Returns the offset of the destination of a register op, it
+// can be patched while it's the end of the code.
+static int GenOperator(sl_script *Script, sl_scope *Scope, sl_node *Node)
+{
+    sl_code *Code = Scope->Code;
+    int Name = Node->Children->Name;
+    sl_node *First = Node->Children->Next;
+    sl_node *Second = First->Next;
+    if (!Script->RegisterOps)
+    {
+        GenExpr(Script, Scope, First);
+        GenExpr(Script, Scope, Second);
+        Emit(Code, Node->OpCode, AddGlobalSite(Script, Name));
+        return -1;
+    }
+
+    // the first operand stays in place only when the second does too, it
+    // would be read after the second is evaluated otherwise
+    uint8 A = RegisterOperand(Scope, First);
+    uint8 B = RegStack;
+    if (A != RegStack)
+    {
+        B = RegisterOperand(Scope, Second);
+        A = B == RegStack ? RegStack : A;
+    }
+    if (A == RegStack)
+    {
+        GenExpr(Script, Scope, First);
+        B = RegisterOperand(Scope, Second);
+    }
+    if (B == RegStack)
+    {
+        GenExpr(Script, Scope, Second);
+        Emit(Code, Node->OpCode, AddGlobalSite(Script, Name));
+        return -1;
+    }
+
+    sl_opcode RegisterOpCode = (sl_opcode)(Node->OpCode - OpCode_Add + (A == RegStack ? OpCode_AddSR : OpCode_AddRR));
+    Emit(Code, RegisterOpCode, AddGlobalSite(Script, Name));
+    Write(Code, A);
+    Write(Code, B);
+    Write(Code, RegStack);
+    return Code->Size - 1;
+}
+
+// calls the callee under the top ArgCount values of the stack
+static void EmitCall(sl_script *Script, sl_scope *Scope, int ArgCount, bool Tail)
+{
+    Emit(Scope->Code, Tail && Script->TailCalls ? OpCode_TailCall : OpCode_FuncCall, ArgCount);
+}
+
+// branches are usually # lambdas, their body is compiled inline instead of
+// creating a function, anything else but a missing branch is evaluated and
+// called
+static void GenBranch(sl_script *Script, sl_scope *Scope, sl_node *Node, bool Tail)
+{
+    if (Node->Type == NodeType_Lambda)
+    {
+        GenExpr(Script, Scope, Node->Children, Tail ? ValueUse_Tail : ValueUse_Push);
+    }
+    else if (Node->Type == NodeType_Nil)
+    {
+        Emit(Scope->Code, OpCode_LoadNil);
+    }
+    else
+    {
+        GenExpr(Script, Scope, Node);
+        EmitCall(Script, Scope, 0, Tail);
+    }
+}
+
+// leaves the value of the branch taken or nil
+static void GenConditional(sl_script *Script, sl_scope *Scope, sl_node *Node, bool Tail)
+{
+    sl_code *Code = Scope->Code;
+    std::vector<int> EndJumps;
+    sl_node *Test = Node->Children;
+    for (int i = 1; i < Node->Count; i += 2)
+    {
+        int Dst = GenExpr(Script, Scope, Test);
+        if (Dst >= 0)
+        {
+            Code->Data[Dst] = RegBranch;
+        }
+        int Else = Emit(Code, OpCode_JumpIfFalse, 0, true);
+
+        GenBranch(Script, Scope, Test->Next, Tail);
+        EndJumps.push_back(Emit(Code, OpCode_Jump, 0, true));
+        Modify(Code, Else, Code->Size);
+        Test = Test->Next->Next;
+    }
+
+    if (Test)
+    {
+        GenBranch(Script, Scope, Test, Tail);
+    }
+    else
+    {
+        Emit(Code, OpCode_LoadNil);
+    }
+
+    for (int Jump : EndJumps)
+    {
+        Modify(Code, Jump, Code->Size);
+    }
+}
+
+// Compiles Node into the code of Scope. Returns the offset of the destination
+// of the register op it ended with, -1 when it didn't.
+static int GenExpr(sl_script *Script, sl_scope *Scope, sl_node *Node, sl_value_use Use)
+{
+    sl_code *Code = Scope->Code;
+    int Dst = -1;
+    switch (Node->Type)
+    {
+    case NodeType_Nil:
+        Emit(Code, OpCode_LoadNil);
+        break;
+
+    case NodeType_Bool:
+        Emit(Code, OpCode_LoadBool, Node->Bool);
+        break;
+
+    case NodeType_Fixnum:
+        Emit(Code, OpCode_LoadFixnum, AddFixnum(Script, Node->Fixnum));
+        break;
+
+    case NodeType_Number:
+        Emit(Code, OpCode_LoadNumber, AddNumber(Script, Node->Number));
+        break;
+
+    case NodeType_String:
+        Emit(Code, OpCode_LoadString, Node->Name);
+        break;
+
+    case NodeType_Symbol:
+        EmitLoad(Script, Scope, ResolveSymbol(Scope, Node->Name));
+        break;
+
+    case NodeType_Call:
+        if (Node->OpCode != OpCode_Halt && Node->Count == 3 &&
+            ResolveSymbol(Scope, Node->Children->Name).Type == VarType_Global)
+        {
+            Dst = GenOperator(Script, Scope, Node);
+            break;
+        }
+        for (sl_node *Child = Node->Children; Child; Child = Child->Next)
+        {
+            GenExpr(Script, Scope, Child);
+        }
+        EmitCall(Script, Scope, Node->Count - 1, Use == ValueUse_Tail);
+        break;
+
+    case NodeType_Lambda:
+        GenFunc(Script, Scope, Node->Children, AddString(Script, "#", 1), -1, 0);
+        break;
+
+    case NodeType_Def:
+    case NodeType_Defun:
+        if (Node->Type == NodeType_Def)
+        {
+            GenDef(Script, Scope, Node);
+        }
+        else
+        {
+            GenDefun(Script, Scope, Node);
+        }
+
+        // definitions don't leave a value, use nil where one is needed
+        if (Use != ValueUse_Pop)
+        {
+            Emit(Code, OpCode_LoadNil);
+        }
+        return -1;
+
+    case NodeType_Cond:
+        GenConditional(Script, Scope, Node, Use == ValueUse_Tail);
+        break;
+    }
+
+    if (Use == ValueUse_Pop)
+    {
+        Emit(Code, OpCode_Pop);
+        return -1;
+    }
+    return Dst;
+}
+
+static void DisasmCode(sl_script *Script, sl_code *Code, int Indent = 0)
+{
+    uint8 *Ptr = Code->Data;
+    uint8 *End = Code->Data + Code->Size;
+    while (Ptr < End)
+    {
+        uint32 Arg;
+        sl_opcode OpCode = Decode(Ptr, &Arg);
+
+        for (int i = 0; i < Indent; i++)
+        {
+            printf("\t");
+        }
+
+        printf("%d", OpCode);
+        printf("\t");
+        switch (OpCode)
+        {
+        case OpCode_StoreLocal:
+            printf("StoreLocal slot:%d", Arg);
+            break;
+
+        case OpCode_StoreUpvalue:
+            printf("StoreUpvalue index:%d", Arg);
+            break;
+
+        case OpCode_StoreCell:
+            printf("StoreCell slot:%d", Arg);
+            break;
+
+        case OpCode_StoreGlobal:
+            printf("StoreGlobal site:%d (%s)", Arg, Script->Strings[Script->GlobalSites[Arg].StringIndex].Value);
+            break;
+
+        case OpCode_DefonceLocal:
+            printf("DefonceLocal slot:%d", Arg);
+            break;
+
+        case OpCode_DefonceCell:
+            printf("DefonceCell slot:%d", Arg);
+            break;
+
+        case OpCode_MakeCell:
+            printf("MakeCell slot:%d", Arg);
+            break;
+
+        case OpCode_DefonceGlobal:
+            printf("DefonceGlobal site:%d (%s)", Arg, Script->Strings[Script->GlobalSites[Arg].StringIndex].Value);
+            break;
+
+        case OpCode_FuncCall:
+            printf("FuncCall args:%d", Arg);
+            break;
+
+        case OpCode_TailCall:
+            printf("TailCall args:%d", Arg);
+            break;
+
+        case OpCode_Add:
+        case OpCode_Sub:
+        case OpCode_Mul:
+        case OpCode_Div:
+        case OpCode_Lt:
+        case OpCode_Gt:
+        case OpCode_Eq:
+        {
+            static const char *Names[] = { "Add", "Sub", "Mul", "Div", "Lt", "Gt", "Eq" };
+            printf("%s site:%d (%s)", Names[OpCode - OpCode_Add], Arg,
+                   Script->Strings[Script->GlobalSites[Arg].StringIndex].Value);
+            break;
+        }
+
+        case OpCode_AddRR:
+        case OpCode_SubRR:
+        case OpCode_MulRR:
+        case OpCode_DivRR:
+        case OpCode_LtRR:
+        case OpCode_GtRR:
+        case OpCode_EqRR:
+        case OpCode_AddSR:
+        case OpCode_SubSR:
+        case OpCode_MulSR:
+        case OpCode_DivSR:
+        case OpCode_LtSR:
+        case OpCode_GtSR:
+        case OpCode_EqSR:
+        {
+            static const char *Names[] = {
+                "AddRR", "SubRR", "MulRR", "DivRR", "LtRR", "GtRR", "EqRR",
+                "AddSR", "SubSR", "MulSR", "DivSR", "LtSR", "GtSR", "EqSR",
+            };
+            printf("%s site:%d (%s)", Names[OpCode - OpCode_AddRR], Arg,
+                   Script->Strings[Script->GlobalSites[Arg].StringIndex].Value);
+            for (int i = 0; i < 3; i++)
+            {
+                uint8 Operand = *Ptr++;
+                printf(i == 2 ? " ->" : " ");
+                if (Operand == RegStack)
+                {
+                    printf(i == 2 ? " push" : "pop");
+                }
+                else if (Operand == RegBranch)
+                {
+                    printf(" branch");
+                }
+                else if (Operand >= RegImmediate)
+                {
+                    printf("#%d", Operand - RegImmediateBias);
+                }
+                else
+                {
+                    printf(i == 2 ? " slot:%d" : "slot:%d", Operand);
+                }
+            }
+            break;
+        }
+
+        case OpCode_LoadNil:
+            printf("LoadNil");
+            break;
+
+        case OpCode_LoadBool:
+            printf("LoadBool %d", Arg);
+            break;
+
+        case OpCode_Jump:
+            printf("Jump to:%d", Arg);
+            break;
+
+        case OpCode_JumpIfFalse:
+            printf("JumpIfFalse to:%d", Arg);
+            break;
+
+        case OpCode_LoadString:
+            printf("LoadString index:%d (%s)", Arg, Script->Strings[Arg].Value);
+            break;
+
+        case OpCode_LoadNumber:
+            printf("LoadNumber index:%d (%g)", Arg, Script->Numbers[Arg]);
+            break;
+
+        case OpCode_LoadFixnum:
+            printf("LoadFixnum index:%d (%lld)", Arg, (long long)Script->Fixnums[Arg]);
+            break;
+
+        case OpCode_LoadLocal:
+            printf("LoadLocal slot:%d", Arg);
+            break;
+
+        case OpCode_LoadUpvalue:
+            printf("LoadUpvalue index:%d", Arg);
+            break;
+
+        case OpCode_LoadCell:
+            printf("LoadCell slot:%d", Arg);
+            break;
+
+        case OpCode_LoadGlobal:
+            printf("LoadGlobal site:%d (%s)", Arg, Script->Strings[Script->GlobalSites[Arg].StringIndex].Value);
+            break;
+
+        case OpCode_LoadSelf:
+            printf("LoadSelf");
+            break;
+
+        case OpCode_LoadFunc:
+            printf("LoadFunc index:%d", Arg);
+            break;
+
+        case OpCode_Return:
+            printf("Return");
+            break;
+
+        case OpCode_Pop:
+            printf("Pop");
+            break;
+
+        case OpCode_Halt:
+            printf("Halt");
+            break;
+
+        default:
+            break;
+        }
+
+        printf("\n");
+    }
+}
+
+void Disasm(sl_script *Script)
+{
+    printf("simple_lisp:\t%s\n\n", Script->Filename);
+    printf("strings:\t");
+    for (auto &Str : Script->Strings)
+    {
+        printf("%s ", Str.Value);
+    }
+    printf("\n\n");
+
+    printf("numbers:\t");
+    for (int i = 0; i < Script->NumberCount; i++)
+    {
+        printf("%g ", Script->Numbers[i]);
+    }
+    printf("\n\n");
+
+    printf("fixnums:\t");
+    for (int i = 0; i < Script->FixnumCount; i++)
+    {
+        printf("%lld ", (long long)Script->Fixnums[i]);
+    }
+    printf("\n\n");
+
+    printf("funcs:\n");
+    for (auto Func : Script->Funcs)
+    {
+        printf("\t%s args:%d locals:%d upvalues:%d stack:%d code (%d bytes):\n",
+               Script->Strings[Func->StringIndex].Value,
+               Func->ArgCount, Func->LocalCount, (int)Func->Captures.size(),
+               Func->MaxStack, Func->Code.Size);
+
+        DisasmCode(Script, &Func->Code, 2);
+        printf("\n");
+    }
+    printf("\n");
+
+    printf("code stack:%d (%d bytes):\n", Script->MaxStack, Script->Code.Size);
+    DisasmCode(Script, &Script->Code);
+}
+
+// Deepest Code takes the operand stack, counting the result a native pushes
+// above its arguments and the operator an operator opcode slides under its
+// operands when it falls back to a call. Jumps only go forward, so the depth
+// at a target is known by the time it's reached.
+static int ComputeMaxStack(sl_code *Code)
+{
+    std::vector<int> TargetDepth(Code->Size + 1, -1);
+    int Depth = 0;
+    int Max = 0;
+    bool Reachable = true;
+
+    uint8 *Ptr = Code->Data;
+    uint8 *End = Code->Data + Code->Size;
+    while (Ptr < End)
+    {
+        int Target = TargetDepth[Ptr - Code->Data];
+        if (Target >= 0 && (!Reachable || Target > Depth))
+        {
+            Depth = Target;
+        }
+        Reachable = true;
+
+        uint32 Arg;
+        sl_opcode OpCode = Decode(Ptr, &Arg);
+        int Peak = Depth;
+        switch (OpCode)
+        {
+        case OpCode_FuncCall:
+        case OpCode_TailCall:
+            Peak = Depth + 1;
+            Depth -= Arg;
+            break;
+
+        case OpCode_LoadNil:
+        case OpCode_LoadBool:
+        case OpCode_LoadString:
+        case OpCode_LoadNumber:
+        case OpCode_LoadFixnum:
+        case OpCode_LoadLocal:
+        case OpCode_LoadUpvalue:
+        case OpCode_LoadCell:
+        case OpCode_LoadGlobal:
+        case OpCode_LoadSelf:
+        case OpCode_LoadFunc:
+            Depth++;
+            break;
+
+        case OpCode_StoreLocal:
+        case OpCode_StoreUpvalue:
+        case OpCode_StoreCell:
+        case OpCode_StoreGlobal:
+        case OpCode_DefonceLocal:
+        case OpCode_DefonceCell:
+        case OpCode_DefonceGlobal:
+        case OpCode_Pop:
+            Depth--;
+            break;
+
+        case OpCode_Add:
+        case OpCode_Sub:
+        case OpCode_Mul:
+        case OpCode_Div:
+        case OpCode_Lt:
+        case OpCode_Gt:
+        case OpCode_Eq:
+            // the generic call pushes the operator under the operands, and a
+            // native pushes its result above them
+            Peak = Depth + 2;
+            Depth--;
+            break;
+
+        case OpCode_AddRR:
+        case OpCode_SubRR:
+        case OpCode_MulRR:
+        case OpCode_DivRR:
+        case OpCode_LtRR:
+        case OpCode_GtRR:
+        case OpCode_EqRR:
+        case OpCode_AddSR:
+        case OpCode_SubSR:
+        case OpCode_MulSR:
+        case OpCode_DivSR:
+        case OpCode_LtSR:
+        case OpCode_GtSR:
+        case OpCode_EqSR:
+        {
+            // the generic call pushes the operator and both operands, and a
+            // native pushes its result above them. The result stays pushed
+            // even when a StoreLocal follows.
+            Depth -= OpCode >= OpCode_AddSR;
+            Peak = Depth + 4;
+            Depth++;
+            Ptr += 3;
+            break;
+        }
+
+        case OpCode_JumpIfFalse:
+            Depth--;
+            if (Arg <= Code->Size && TargetDepth[Arg] < Depth)
+            {
+                TargetDepth[Arg] = Depth;
+            }
+            break;
+
+        case OpCode_Jump:
+            if (Arg <= Code->Size && TargetDepth[Arg] < Depth)
+            {
+                TargetDepth[Arg] = Depth;
+            }
+            Reachable = false;
+            break;
+
+        case OpCode_Return:
+        case OpCode_Halt:
+            Reachable = false;
+            break;
+
+        default:
+            break;
+        }
+
+        if (Peak > Max)
+        {
+            Max = Peak;
+        }
+        if (Depth > Max)
+        {
+            Max = Depth;
+        }
+    }
+    return Max;
+}
+
+// An instruction of the optimizer, jumps hold the index of their target
+// instead of an offset.
+struct sl_instr
+{
+    sl_opcode OpCode;
+    uint32 Arg;
+    uint8 Operands[3];
+    bool Dead = false;
+    bool Target = false;
+};
+
+inline bool IsRegisterOp(sl_opcode OpCode)
+{
+    return OpCode >= OpCode_AddRR && OpCode <= OpCode_EqSR;
+}
+
+inline bool IsJump(sl_opcode OpCode)
+{
+    return OpCode == OpCode_Jump || OpCode == OpCode_JumpIfFalse;
+}
+
+// opcodes that only push a value, dropping them and the Pop after them
+// changes nothing
+inline bool IsPurePush(sl_opcode OpCode)
+{
+    return OpCode >= OpCode_LoadNil && OpCode <= OpCode_LoadFunc;
+}
+
+// the value a constant load pushes, false if Instr isn't one
+static bool ConstantValue(sl_script *Script, sl_instr *Instr, sl_value *Value)
+{
+    switch (Instr->OpCode)
+    {
+    case OpCode_LoadNil:
+        *Value = sl_value{};
+        return true;
+
+    case OpCode_LoadBool:
+        *Value = CreateBool(Instr->Arg == 1);
+        return true;
+
+    case OpCode_LoadNumber:
+        *Value = CreateDouble(Script->Numbers[Instr->Arg]);
+        return true;
+
+    case OpCode_LoadFixnum:
+        *Value = CreateFixnum(Script->Fixnums[Instr->Arg]);
+        return true;
+
+    case OpCode_LoadString:
+        *Value = StringValue(&Script->Strings[Instr->Arg]);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// turns Instr into the load of a number or bool
+static void LoadConstant(sl_script *Script, sl_instr *Instr, sl_value Value)
+{
+    if (Is(Value, Bool))
+    {
+        Instr->OpCode = OpCode_LoadBool;
+        Instr->Arg = AsBool(Value);
+    }
+    else if (Is(Value, Fixnum))
+    {
+        Instr->OpCode = OpCode_LoadFixnum;
+        Instr->Arg = AddFixnum(Script, AsFixnum(Value));
+    }
+    else
+    {
+        Instr->OpCode = OpCode_LoadNumber;
+        Instr->Arg = AddNumber(Script, AsDouble(Value));
+    }
+}
+
+// the result of the operator of OpCode (either form) on two numbers
+static sl_value FoldOperator(sl_opcode OpCode, sl_value A, sl_value B)
+{
+    int Operator = IsRegisterOp(OpCode) ? (OpCode - OpCode_AddRR) % 7 : OpCode - OpCode_Add;
+    switch (Operator)
+    {
+    case 0: return NumberAdd(A, B);
+    case 1: return NumberSub(A, B);
+    case 2: return NumberMul(A, B);
+    case 3: return NumberDiv(A, B);
+    case 4: return CreateBool(NumberLess(A, B));
+    case 5: return CreateBool(NumberLess(B, A));
+    default: return CreateBool(NumberEqual(A, B));
+    }
+}
+
+struct sl_optimizer
+{
+    sl_script *Script;
+    sl_func *Func;
+    std::vector<sl_instr> Instrs;
+
+    // string indices of the globals the script stores to, their operators
+    // can't be folded
+    std::vector<bool> *Stored;
+};
+
+// index of the first live instruction from Index on, Instrs.size() if none
+static int NextLive(sl_optimizer *Opt, int Index)
+{
+    while (Index < Opt->Instrs.size() && Opt->Instrs[Index].Dead)
+    {
+        Index++;
+    }
+    return Index;
+}
+
+static int PrevLive(sl_optimizer *Opt, int Index)
+{
+    Index--;
+    while (Index >= 0 && Opt->Instrs[Index].Dead)
+    {
+        Index--;
+    }
+    return Index;
+}
+
+// A StoreLocal or JumpIfFalse right after a register operator may be its
+// destination, the operator has to push again before either is changed.
+static void Unfuse(sl_optimizer *Opt, int Index)
+{
+    int Prev = PrevLive(Opt, Index);
+    if (Prev >= 0 && IsRegisterOp(Opt->Instrs[Prev].OpCode))
+    {
+        Opt->Instrs[Prev].Operands[2] = RegStack;
+    }
+}
+
+static void MarkTargets(sl_optimizer *Opt)
+{
+    for (auto &Instr : Opt->Instrs)
+    {
+        Instr.Target = false;
+    }
+    for (auto &Instr : Opt->Instrs)
+    {
+        if (!Instr.Dead && IsJump(Instr.OpCode) && Instr.Arg < Opt->Instrs.size())
+        {
+            Opt->Instrs[Instr.Arg].Target = true;
+        }
+    }
+}
+
+// folds operators on number constants, Instr is the operator
+static bool FoldConstants(sl_optimizer *Opt, int Index)
+{
+    sl_instr *Instr = &Opt->Instrs[Index];
+    bool Register = IsRegisterOp(Instr->OpCode);
+    if (!Register && (Instr->OpCode < OpCode_Add || Instr->OpCode > OpCode_Eq))
+    {
+        return false;
+    }
+    if ((*Opt->Stored)[Opt->Script->GlobalSites[Instr->Arg].StringIndex])
+    {
+        return false;
+    }
+
+    // the operands that come from the stack are the constant loads before it
+    int StackOperands = Register ? Instr->OpCode >= OpCode_AddSR : 2;
+    sl_value Operands[2];
+    int Loads[2];
+    int Prev = Index;
+    for (int i = StackOperands - 1; i >= 0; i--)
+    {
+        if (Opt->Instrs[Prev].Target)
+        {
+            return false;
+        }
+        Prev = PrevLive(Opt, Prev);
+        if (Prev < 0 || !ConstantValue(Opt->Script, &Opt->Instrs[Prev], &Operands[i]))
+        {
+            return false;
+        }
+        Loads[i] = Prev;
+    }
+    for (int i = StackOperands; i < 2; i++)
+    {
+        uint8 Operand = Instr->Operands[i];
+        if (Operand < RegImmediate || Operand >= RegBranch)
+        {
+            return false;
+        }
+        Operands[i] = CreateFixnum((int)Operand - RegImmediateBias);
+    }
+    if (!IsNumber(Operands[0]) || !IsNumber(Operands[1]))
+    {
+        return false;
+    }
+
+    // a destination other than the stack is done by the instruction after
+    LoadConstant(Opt->Script, Instr, FoldOperator(Instr->OpCode, Operands[0], Operands[1]));
+    for (int i = 0; i < StackOperands; i++)
+    {
+        Opt->Instrs[Loads[i]].Dead = true;
+    }
+    return true;
+}
+
+// JumpIfFalse after a constant is either always taken or never
+static bool FoldBranch(sl_optimizer *Opt, int Index)
+{
+    sl_instr *Instr = &Opt->Instrs[Index];
+    int Prev = PrevLive(Opt, Index);
+    sl_value Value;
+    if (Instr->OpCode != OpCode_JumpIfFalse || Instr->Target || Prev < 0 ||
+        !ConstantValue(Opt->Script, &Opt->Instrs[Prev], &Value))
+    {
+        return false;
+    }
+
+    Opt->Instrs[Prev].Dead = true;
+    if (IsFalse(Value))
+    {
+        Instr->OpCode = OpCode_Jump;
+    }
+    else
+    {
+        Instr->Dead = true;
+    }
+    return true;
+}
+
+static bool ThreadJump(sl_optimizer *Opt, int Index)
+{
+    sl_instr *Instr = &Opt->Instrs[Index];
+    if (!IsJump(Instr->OpCode))
+    {
+        return false;
+    }
+
+    bool Changed = false;
+    int Target = NextLive(Opt, Instr->Arg);
+    for (int Hops = 0; Target < Opt->Instrs.size() && Opt->Instrs[Target].OpCode == OpCode_Jump &&
+                       Hops < Opt->Instrs.size(); Hops++)
+    {
+        Target = NextLive(Opt, Opt->Instrs[Target].Arg);
+    }
+    if (Target != Instr->Arg)
+    {
+        Instr->Arg = Target;
+        Changed = true;
+    }
+
+    if (Target == NextLive(Opt, Index + 1))
+    {
+        // a JumpIfFalse to the next instruction still drops its test
+        if (Instr->OpCode == OpCode_JumpIfFalse)
+        {
+            Unfuse(Opt, Index);
+            Instr->OpCode = OpCode_Pop;
+        }
+        else
+        {
+            Instr->Dead = true;
+        }
+        return true;
+    }
+    if (Instr->OpCode == OpCode_Jump && Target < Opt->Instrs.size() &&
+        Opt->Instrs[Target].OpCode == OpCode_Return)
+    {
+        Instr->OpCode = OpCode_Return;
+        return true;
+    }
+    return Changed;
+}
+
+// a load right before a Pop does nothing
+static bool RemovePop(sl_optimizer *Opt, int Index)
+{
+    sl_instr *Instr = &Opt->Instrs[Index];
+    int Prev = PrevLive(Opt, Index);
+    if (Instr->OpCode != OpCode_Pop || Instr->Target || Prev < 0 ||
+        !IsPurePush(Opt->Instrs[Prev].OpCode))
+    {
+        return false;
+    }
+
+    Opt->Instrs[Prev].Dead = true;
+    Instr->Dead = true;
+    return true;
+}
+
+// code after a Jump or Return that no jump lands on never runs
+static bool RemoveUnreachable(sl_optimizer *Opt, int Index)
+{
+    sl_opcode OpCode = Opt->Instrs[Index].OpCode;
+    if (OpCode != OpCode_Jump && OpCode != OpCode_Return)
+    {
+        return false;
+    }
+
+    bool Changed = false;
+    for (int i = Index + 1; i < Opt->Instrs.size() && !Opt->Instrs[i].Target; i++)
+    {
+        Changed |= !Opt->Instrs[i].Dead;
+        Opt->Instrs[i].Dead = true;
+    }
+    return Changed;
+}
+
+// Locals nothing reads are stored to with a Pop instead. A local is read by
+// LoadLocal, DefonceLocal, MakeCell, a register operand or a closure capturing
+// it.
+static bool RemoveDeadStores(sl_optimizer *Opt)
+{
+    if (!Opt->Func)
+    {
+        return false;
+    }
+
+    std::vector<bool> Read(Opt->Func->LocalCount, false);
+    for (auto &Instr : Opt->Instrs)
+    {
+        if (Instr.Dead)
+        {
+            continue;
+        }
+        if ((Instr.OpCode == OpCode_LoadLocal || Instr.OpCode == OpCode_DefonceLocal ||
+             Instr.OpCode == OpCode_MakeCell) && Instr.Arg < Read.size())
+        {
+            Read[Instr.Arg] = true;
+        }
+        else if (IsRegisterOp(Instr.OpCode))
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                if (Instr.Operands[i] < RegImmediate && Instr.Operands[i] < Read.size())
+                {
+                    Read[Instr.Operands[i]] = true;
+                }
+            }
+        }
+        else if (Instr.OpCode == OpCode_LoadFunc)
+        {
+            for (auto &Capture : Opt->Script->Funcs[Instr.Arg]->Captures)
+            {
+                if (Capture.Type == VarType_Local && Capture.Index < Read.size())
+                {
+                    Read[Capture.Index] = true;
+                }
+            }
+        }
+    }
+
+    bool Changed = false;
+    for (int i = 0; i < Opt->Instrs.size(); i++)
+    {
+        sl_instr *Instr = &Opt->Instrs[i];
+        if (!Instr->Dead && Instr->OpCode == OpCode_StoreLocal && Instr->Arg < Read.size() &&
+            !Read[Instr->Arg])
+        {
+            Unfuse(Opt, i);
+            Instr->OpCode = OpCode_Pop;
+            Changed = true;
+        }
+    }
+    return Changed;
+}
+
+static void MarkStoredGlobals(sl_script *Script, sl_code *Code, std::vector<bool> *Stored)
+{
+    uint8 *Ptr = Code->Data;
+    uint8 *End = Code->Data + Code->Size;
+    while (Ptr < End)
+    {
+        uint32 Arg;
+        sl_opcode OpCode = Decode(Ptr, &Arg);
+        if (OpCode == OpCode_StoreGlobal || OpCode == OpCode_DefonceGlobal)
+        {
+            (*Stored)[Script->GlobalSites[Arg].StringIndex] = true;
+        }
+        else if (IsRegisterOp(OpCode))
+        {
+            Ptr += 3;
+        }
+    }
+}
+
+// Rewrites Code until none of the rules apply. Func is NULL for the main
+// code. Operators are only folded when the script never assigns them,
+// assuming they're still the builtins otherwise.
+static void OptimizeCode(sl_script *Script, sl_func *Func, sl_code *Code, std::vector<bool> *Stored)
+{
+    sl_optimizer Opt;
+    Opt.Script = Script;
+    Opt.Func = Func;
+    Opt.Stored = Stored;
+
+    std::vector<int> IndexAt(Code->Size + 1, -1);
+    uint8 *Ptr = Code->Data;
+    uint8 *End = Code->Data + Code->Size;
+    while (Ptr < End)
+    {
+        IndexAt[Ptr - Code->Data] = Opt.Instrs.size();
+
+        sl_instr Instr;
+        Instr.OpCode = Decode(Ptr, &Instr.Arg);
+        if (IsRegisterOp(Instr.OpCode))
+        {
+            memcpy(Instr.Operands, Ptr, 3);
+            Ptr += 3;
+        }
+        Opt.Instrs.push_back(Instr);
+    }
+    IndexAt[Code->Size] = Opt.Instrs.size();
+    for (auto &Instr : Opt.Instrs)
+    {
+        if (IsJump(Instr.OpCode))
+        {
+            Instr.Arg = Instr.Arg <= Code->Size && IndexAt[Instr.Arg] >= 0 ? IndexAt[Instr.Arg] : Opt.Instrs.size();
+        }
+    }
+
+    bool Changed = true;
+    while (Changed)
+    {
+        MarkTargets(&Opt);
+        Changed = RemoveDeadStores(&Opt);
+        for (int i = 0; i < Opt.Instrs.size(); i++)
+        {
+            if (!Opt.Instrs[i].Dead)
+            {
+                Changed |= FoldConstants(&Opt, i) || FoldBranch(&Opt, i) || ThreadJump(&Opt, i) ||
+                           RemovePop(&Opt, i) || RemoveUnreachable(&Opt, i);
+            }
+        }
+    }
+
+    // dead instructions take the offset of the next live one, so jumps to
+    // them land there
+    sl_code Result;
+    std::vector<int> Offsets(Opt.Instrs.size() + 1);
+    for (int i = 0; i < Opt.Instrs.size(); i++)
+    {
+        sl_instr &Instr = Opt.Instrs[i];
+        Offsets[i] = Result.Size;
+        if (Instr.Dead)
+        {
+            continue;
+        }
+
+        Emit(&Result, Instr.OpCode, Instr.Arg, IsJump(Instr.OpCode));
+        if (IsRegisterOp(Instr.OpCode))
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                Write(&Result, Instr.Operands[j]);
+            }
+        }
+    }
+    Offsets[Opt.Instrs.size()] = Result.Size;
+    for (int i = 0; i < Opt.Instrs.size(); i++)
+    {
+        if (!Opt.Instrs[i].Dead && IsJump(Opt.Instrs[i].OpCode))
+        {
+            Modify(&Result, Offsets[i], Offsets[Opt.Instrs[i].Arg]);
+        }
+    }
+
+    delete[] Code->Data;
+    *Code = Result;
+}
+
+void CompileScript(sl_script *Script, const char *Source)
+{
+    sl_lexer Lexer;
+    InitLexer(&Lexer, Source);
+
+    sl_arena Arena;
+    sl_scope Scope;
+    Scope.Code = &Script->Code;
+    while (Lexer.TokenType != TokenType_EOF)
+    {
+        // a stray ')' doesn't start an expression
+        if (Lexer.TokenType == TokenType_RightParen)
+        {
+            NextToken(&Lexer);
+            continue;
+        }
+
+        GenExpr(Script, &Scope, ParseExpr(Script, &Arena, &Lexer), ValueUse_Pop);
+        ResetArena(&Arena);
+    }
+    Emit(&Script->Code, OpCode_Halt);
+    FreeArena(&Arena);
+
+    if (Script->Optimize)
+    {
+        std::vector<bool> Stored(Script->Strings.size(), false);
+        MarkStoredGlobals(Script, &Script->Code, &Stored);
+        for (auto Func : Script->Funcs)
+        {
+            MarkStoredGlobals(Script, &Func->Code, &Stored);
+        }
+        for (auto Func : Script->Funcs)
+        {
+            OptimizeCode(Script, Func, &Func->Code, &Stored);
+        }
+        OptimizeCode(Script, NULL, &Script->Code, &Stored);
+    }
+
+    for (auto Func : Script->Funcs)
+    {
+        Func->MaxStack = ComputeMaxStack(&Func->Code);
+    }
+    Script->MaxStack = ComputeMaxStack(&Script->Code);
+}
+
+// Precompiled scripts. Images are laid out so they can be mapped read-only and
+// executed in place: code, string bytes and the number pool are used directly
+// from the mapping, only the string and function headers (which hold pointers)
+// are built on load. Every section is 8 byte aligned and all fields are in host
+// byte order.
+//
+//   sl_image_header
+//   strings      StringCount x sl_image_string
+//   string data  NUL terminated bytes, referenced by sl_image_string::Offset
+//   numbers      NumberCount x double
+//   fixnums      FixnumCount x int64_t
+//   funcs        FuncCount x sl_image_func
+//   captures     CaptureCount x sl_capture, referenced by sl_image_func::CaptureOffset
+//   globals      GlobalSiteCount x uint32, the string index of each global access site
+//   code         function code followed by the main code, referenced by offsets
+#define ImageMagic "SLBC"
+#define ImageVersion 13
+
+struct sl_image_header
+{
+    char Magic[4];
+    uint32 Version;
+    uint32 StringCount;
+    uint32 NumberCount;
+    uint32 FixnumCount;
+    uint32 FuncCount;
+    uint32 CodeSize;
+    uint32 StringsOffset;
+    uint32 StringDataOffset;
+    uint32 NumbersOffset;
+    uint32 FixnumsOffset;
+    uint32 FuncsOffset;
+    uint32 CapturesOffset;
+    uint32 CaptureCount;
+    uint32 GlobalSitesOffset;
+    uint32 GlobalSiteCount;
+    uint32 CodeOffset;
+    uint32 ImageSize;
+    uint32 MaxStack;
+};
+
+struct sl_image_string
+{
+    uint32 Offset;
+    uint32 Size;
+    uint32 Hash;
+};
+
+struct sl_image_func
+{
+    int32_t StringIndex;
+    int32_t ArgCount;
+    int32_t LocalCount;
+    int32_t MaxStack;
+    uint32 CaptureOffset;
+    uint32 CaptureCount;
+    uint32 CodeOffset;
+    uint32 CodeSize;
+};
+
+inline bool IsImage(const char *Data, long int Size)
+{
+    return Size >= 4 && memcmp(Data, ImageMagic, 4) == 0;
+}
+
+// only regular files are checked, peeking at a pipe would eat its input
+bool IsImageFile(const char *Filename)
+{
+#ifndef _WIN32
+    struct stat Stat;
+    if (stat(Filename, &Stat) != 0 || !S_ISREG(Stat.st_mode))
+    {
+        return false;
+    }
+#endif
+
+    char Magic[4];
+    FILE *Handle = fopen(Filename, "rb");
+    if (!Handle)
+    {
+        return false;
+    }
+    long int Size = fread(Magic, 1, sizeof(Magic), Handle);
+    fclose(Handle);
+    return IsImage(Magic, Size);
+}
+
+inline uint32 AlignImage(uint32 Offset)
+{
+    return (Offset + 7) & ~7u;
+}
+
+static void PadImage(FILE *Handle, uint32 *Offset)
+{
+    static const char Zero[8] = {};
+    uint32 Aligned = AlignImage(*Offset);
+    fwrite(Zero, 1, Aligned - *Offset, Handle);
+    *Offset = Aligned;
+}
+
+static void WritePadded(FILE *Handle, const void *Data, uint32 Size, uint32 *Offset)
+{
+    fwrite(Data, 1, Size, Handle);
+    *Offset += Size;
+    PadImage(Handle, Offset);
+}
+
+bool WriteScript(sl_script *Script, const char *Filename)
+{
+    FILE *Handle = fopen(Filename, "wb");
+    if (!Handle)
+    {
+        printf("error: can't open '%s' for writing\n", Filename);
+        return false;
+    }
+
+    std::vector<sl_image_string> Strings;
+    uint32 StringDataSize = 0;
+    for (auto &Str : Script->Strings)
+    {
+        sl_image_string Record;
+        Record.Offset = StringDataSize;
+        Record.Size = (uint32)Str.Size;
+        Record.Hash = Str.Hash;
+        Strings.push_back(Record);
+        StringDataSize += Str.Size + 1;
+    }
+
+    std::vector<sl_image_func> Funcs;
+    std::vector<sl_capture> Captures;
+    uint32 CodeSize = 0;
+    for (auto Func : Script->Funcs)
+    {
+        sl_image_func Record = {};
+        Record.StringIndex = Func->StringIndex;
+        Record.ArgCount = Func->ArgCount;
+        Record.LocalCount = Func->LocalCount;
+        Record.MaxStack = Func->MaxStack;
+        Record.CaptureOffset = Captures.size();
+        Record.CaptureCount = Func->Captures.size();
+        Captures.insert(Captures.end(), Func->Captures.begin(), Func->Captures.end());
+        Record.CodeOffset = CodeSize;
+        Record.CodeSize = Func->Code.Size;
+        Funcs.push_back(Record);
+        CodeSize += Func->Code.Size;
+    }
+
+    std::vector<uint32> GlobalSites;
+    for (auto &Site : Script->GlobalSites)
+    {
+        GlobalSites.push_back(Site.StringIndex);
+    }
+
+    sl_image_header Header = {};
+    memcpy(Header.Magic, ImageMagic, 4);
+    Header.Version = ImageVersion;
+    Header.StringCount = Strings.size();
+    Header.NumberCount = Script->NumberCount;
+    Header.FixnumCount = Script->FixnumCount;
+    Header.FuncCount = Funcs.size();
+    Header.CodeSize = Script->Code.Size;
+    Header.MaxStack = Script->MaxStack;
+    Header.StringsOffset = AlignImage(sizeof(Header));
+    Header.StringDataOffset = AlignImage(Header.StringsOffset + Strings.size()*sizeof(sl_image_string));
+    Header.NumbersOffset = AlignImage(Header.StringDataOffset + StringDataSize);
+    Header.FixnumsOffset = AlignImage(Header.NumbersOffset + Script->NumberCount*sizeof(double));
+    Header.FuncsOffset = AlignImage(Header.FixnumsOffset + Script->FixnumCount*sizeof(int64_t));
+    Header.CapturesOffset = AlignImage(Header.FuncsOffset + Funcs.size()*sizeof(sl_image_func));
+    Header.CaptureCount = Captures.size();
+    Header.GlobalSitesOffset = AlignImage(Header.CapturesOffset + Captures.size()*sizeof(sl_capture));
+    Header.GlobalSiteCount = GlobalSites.size();
+    Header.CodeOffset = AlignImage(Header.GlobalSitesOffset + GlobalSites.size()*sizeof(uint32));
+    Header.ImageSize = Header.CodeOffset + CodeSize + Script->Code.Size;
+
+    uint32 Offset = 0;
+    WritePadded(Handle, &Header, sizeof(Header), &Offset);
+    WritePadded(Handle, Strings.data(), Strings.size()*sizeof(sl_image_string), &Offset);
+
+    for (auto &Str : Script->Strings)
+    {
+        fwrite(Str.Value, 1, Str.Size + 1, Handle);
+    }
+    Offset += StringDataSize;
+    PadImage(Handle, &Offset);
+
+    WritePadded(Handle, Script->Numbers, Script->NumberCount*sizeof(double), &Offset);
+    WritePadded(Handle, Script->Fixnums, Script->FixnumCount*sizeof(int64_t), &Offset);
+    WritePadded(Handle, Funcs.data(), Funcs.size()*sizeof(sl_image_func), &Offset);
+    WritePadded(Handle, Captures.data(), Captures.size()*sizeof(sl_capture), &Offset);
+    WritePadded(Handle, GlobalSites.data(), GlobalSites.size()*sizeof(uint32), &Offset);
+
+    for (auto Func : Script->Funcs)
+    {
+        fwrite(Func->Code.Data, 1, Func->Code.Size, Handle);
+    }
+    fwrite(Script->Code.Data, 1, Script->Code.Size, Handle);
+
+    bool Ok = !ferror(Handle);
+    fclose(Handle);
+    if (!Ok)
+    {
+        printf("error: failed writing '%s'\n", Filename);
+    }
+    return Ok;
+}
+
+inline bool InImage(const sl_image_header *Header, uint32 Offset, uint64_t Size)
+{
+    return Offset <= Header->ImageSize && Size <= Header->ImageSize - Offset;
+}
+
+// Builds Script on top of Data without copying code, string bytes or numbers,
+// so Data has to outlive the script.
+bool LoadScript(sl_script *Script, const char *Data, long int Size)
+{
+    const sl_image_header *Header = (const sl_image_header *)Data;
+    if (Size < (long int)sizeof(sl_image_header) || !IsImage(Data, Size))
+    {
+        printf("error: %s: not a simple_lisp image\n", Script->Filename);
+        return false;
+    }
+    if (Header->Version != ImageVersion)
+    {
+        printf("error: %s: image version %u, expected %u\n",
+               Script->Filename, Header->Version, ImageVersion);
+        return false;
+    }
+    if (Header->ImageSize > Size ||
+        !InImage(Header, Header->StringsOffset, (uint64_t)Header->StringCount*sizeof(sl_image_string)) ||
+        !InImage(Header, Header->NumbersOffset, (uint64_t)Header->NumberCount*sizeof(double)) ||
+        !InImage(Header, Header->FixnumsOffset, (uint64_t)Header->FixnumCount*sizeof(int64_t)) ||
+        !InImage(Header, Header->FuncsOffset, (uint64_t)Header->FuncCount*sizeof(sl_image_func)) ||
+        !InImage(Header, Header->CapturesOffset, (uint64_t)Header->CaptureCount*sizeof(sl_capture)) ||
+        !InImage(Header, Header->GlobalSitesOffset, (uint64_t)Header->GlobalSiteCount*sizeof(uint32)) ||
+        !InImage(Header, Header->CodeOffset, 0))
+    {
+        printf("error: %s: truncated image\n", Script->Filename);
+        return false;
+    }
+
+    const sl_image_string *Strings = (const sl_image_string *)(Data + Header->StringsOffset);
+    Script->Strings.resize(Header->StringCount);
+    for (uint32 i = 0; i < Header->StringCount; i++)
+    {
+        uint32 Offset = Header->StringDataOffset + Strings[i].Offset;
+        if (!InImage(Header, Offset, (uint64_t)Strings[i].Size + 1))
+        {
+            printf("error: %s: truncated image\n", Script->Filename);
+            return false;
+        }
+
+        sl_string &Str = Script->Strings[i];
+        Str.Size = Strings[i].Size;
+        Str.Hash = Strings[i].Hash;
+        Str.Value = (char *)(Data + Offset);
+    }
+
+    Script->Numbers = (double *)(Data + Header->NumbersOffset);
+    Script->NumberCount = Header->NumberCount;
+    Script->Fixnums = (int64_t *)(Data + Header->FixnumsOffset);
+    Script->FixnumCount = Header->FixnumCount;
+
+    // the caches are written to while running, so they can't live in the image
+    const uint32 *GlobalSites = (const uint32 *)(Data + Header->GlobalSitesOffset);
+    for (uint32 i = 0; i < Header->GlobalSiteCount; i++)
+    {
+        if (GlobalSites[i] >= Header->StringCount)
+        {
+            printf("error: %s: bad global site %u\n", Script->Filename, i);
+            return false;
+        }
+        AddGlobalSite(Script, GlobalSites[i]);
+    }
+
+    const sl_image_func *Funcs = (const sl_image_func *)(Data + Header->FuncsOffset);
+    const sl_capture *Captures = (const sl_capture *)(Data + Header->CapturesOffset);
+    uint32 CodeOffset = Header->CodeOffset;
+    for (uint32 i = 0; i < Header->FuncCount; i++)
+    {
+        if (Funcs[i].CodeOffset != CodeOffset - Header->CodeOffset ||
+            !InImage(Header, CodeOffset, Funcs[i].CodeSize) ||
+            Funcs[i].CaptureOffset > Header->CaptureCount ||
+            Funcs[i].CaptureCount > Header->CaptureCount - Funcs[i].CaptureOffset)
+        {
+            printf("error: %s: truncated image\n", Script->Filename);
+            return false;
+        }
+
+        sl_func *Func = new sl_func;
+        Func->StringIndex = Funcs[i].StringIndex;
+        Func->ArgCount = Funcs[i].ArgCount;
+        Func->LocalCount = Funcs[i].LocalCount;
+        Func->MaxStack = Funcs[i].MaxStack;
+        Func->Captures.assign(Captures + Funcs[i].CaptureOffset,
+                              Captures + Funcs[i].CaptureOffset + Funcs[i].CaptureCount);
+        Func->Code.Size = Funcs[i].CodeSize;
+        Func->Code.Data = (uint8 *)(Data + CodeOffset);
+        Script->Funcs.push_back(Func);
+        CodeOffset += Funcs[i].CodeSize;
+    }
+
+    if (!InImage(Header, CodeOffset, Header->CodeSize))
+    {
+        printf("error: %s: truncated image\n", Script->Filename);
+        return false;
+    }
+    Script->Code.Size = Header->CodeSize;
+    Script->Code.Data = (uint8 *)(Data + CodeOffset);
+    Script->MaxStack = Header->MaxStack;
+    return true;
+}
+
+// Maps the image read-only so processes running the same image share its pages.
+bool LoadScriptFile(sl_script *Script, const char *Filename)
+{
+#ifdef _WIN32
+    FILE *Handle;
+    fopen_s(&Handle, Filename, "rb");
+    if (!Handle)
+    {
+        printf("error: can't open '%s'\n", Filename);
+        return false;
+    }
+
+    fseek(Handle, 0, SEEK_END);
+    long int Size = ftell(Handle);
+    rewind(Handle);
+
+    char *Data = new char[Size];
+    Size = fread(Data, 1, Size, Handle);
+    fclose(Handle);
+#else
+    int Fd = open(Filename, O_RDONLY);
+    if (Fd < 0)
+    {
+        printf("error: can't open '%s'\n", Filename);
+        return false;
+    }
+
+    struct stat Stat;
+    if (fstat(Fd, &Stat) != 0)
+    {
+        printf("error: can't open '%s'\n", Filename);
+        close(Fd);
+        return false;
+    }
+
+    long int Size = Stat.st_size;
+    void *Data = mmap(NULL, Size, PROT_READ, MAP_SHARED, Fd, 0);
+    close(Fd);
+    if (Data == MAP_FAILED)
+    {
+        printf("error: can't map '%s'\n", Filename);
+        return false;
+    }
+#endif
+
+    Script->Image = (const char *)Data;
+    Script->ImageSize = Size;
+    if (LoadScript(Script, (const char *)Data, Size))
+    {
+        return true;
+    }
+
+    // a rejected image may have been loaded part way, drop everything that
+    // points into it before it goes
+    for (auto Func : Script->Funcs)
+    {
+        delete Func;
+    }
+    Script->Funcs.clear();
+    Script->Strings.clear();
+    Script->Numbers = NULL;
+    Script->NumberCount = 0;
+    Script->Fixnums = NULL;
+    Script->FixnumCount = 0;
+    Script->Code = sl_code();
+    Script->Image = NULL;
+    Script->ImageSize = 0;
+#ifdef _WIN32
+    delete[] Data;
+#else
+    munmap(Data, Size);
+#endif
+    return false;
 }
 
-static bool ParseReserved(sl_script *Script, sl_code *Code, sl_lexer *Lexer)
+struct sl_file_data
 {
-    switch (Lexer->StringSize)
+    // always NUL terminated, NULL if the file couldn't be read
+    const char *Data = NULL;
+    long int Size = 0;
+
+    // non zero when Data is a mapping of the file
+    long int MapSize = 0;
+};
+
+static char *
+ReadStream(FILE *Handle, long int *Size)
+{
+    long int Capacity = 1 << 16;
+    long int Length = 0;
+    char *Buffer = new char[Capacity];
+    for (;;)
     {
-    case 7:
-        if (strcmp("defonce", Lexer->StringVal) == 0)
+        Length += fread(Buffer + Length, 1, Capacity - Length - 1, Handle);
+        if (Length < Capacity - 1)
         {
-            NextToken(Lexer);
-            if (Lexer->TokenType != TokenType_Symbol)
-            {
-                printf("error: defonce expecting symbol\n");
-                return true;
-            }
-
-            AddDefOp(Script, Code, Lexer, OpCode_Defonce);
-            return true;
+            break;
         }
-        break;
 
-    case 5:
-        if (strcmp("defun", Lexer->StringVal) == 0)
-        {
-            NextToken(Lexer);
-            if (Lexer->TokenType != TokenType_Symbol)
-            {
-                printf("error: defun expecting symbol\n");
-                return true;
-            }
+        char *NewBuffer = new char[Capacity*2];
+        memcpy(NewBuffer, Buffer, Length);
+        delete[] Buffer;
+        Buffer = NewBuffer;
+        Capacity *= 2;
+    }
 
-            sl_func *Func = new sl_func;
-            Func->StringIndex = AddString(Script, Lexer->StringVal, Lexer->StringSize);
-            NextToken(Lexer);
-            if (Lexer->TokenType == TokenType_LeftBracket)
-            {
-                NextToken(Lexer);
-                int ArgIndex = 0;
-                while (Lexer->TokenType == TokenType_Symbol)
-                {
-                    if (ArgIndex >= FuncMaxArgs)
-                    {
-                        printf("error: function '%s': can't have more than %d arguments\n",
-                               Script->Strings[Func->StringIndex],
-                               FuncMaxArgs);
-                    }
-                    Func->Args[ArgIndex] = AddString(Script, Lexer->StringVal, Lexer->StringSize);
-                    NextToken(Lexer);
-                    ArgIndex++;
-                }
-                for (int i = ArgIndex-1; i >= 0; --i)
-                {
-                    Emit(&Func->Code, OpCode_Def, Func->Args[i]);
-                }
-                Func->ArgCount = ArgIndex;
+    Buffer[Length] = '\0';
+    *Size = Length;
+    return Buffer;
+}
 
-                if (Lexer->TokenType != TokenType_RightBracket)
-                {
-                    printf("error: function '%s': expecting ']' to close arguments\n",
-                           Script->Strings[Func->StringIndex].Value);
-                }
-                NextToken(Lexer);
-            }
-            else
-            {
-                printf("error: function '%s': expecting function arguments\n",
-                       Script->Strings[Func->StringIndex].Value);
-            }
+// Regular files are mapped, the lexer and println rely on the zero fill past
+// the end of the last page for the terminator, so files that end exactly on a
+// page boundary are read in bulk instead. Pipes and "-" (stdin) are read in
+// bulk as well.
+static sl_file_data
+ReadFile(const char *Filename)
+{
+    sl_file_data Result;
+    if (strcmp(Filename, "-") == 0)
+    {
+        Result.Data = ReadStream(stdin, &Result.Size);
+        return Result;
+    }
 
-            while (Lexer->TokenType != TokenType_RightParen)
-            {
-                ParseExpr(Script, &Func->Code, Lexer, true);
-            }
-            NextToken(Lexer);
-            Emit(&Func->Code, OpCode_Return);
+#ifdef _WIN32
+    FILE *Handle;
+    fopen_s(&Handle, Filename, "r");
+    if (Handle)
+    {
+        Result.Data = ReadStream(Handle, &Result.Size);
+        fclose(Handle);
+    }
+#else
+    int Fd = open(Filename, O_RDONLY);
+    if (Fd < 0)
+    {
+        return Result;
+    }
 
-            Script->Funcs.push_back(Func);
-            Emit(Code, OpCode_Defun, (uint8)(Script->Funcs.size() - 1));
-            return true;
+    struct stat Stat;
+    long int PageSize = sysconf(_SC_PAGESIZE);
+    if (fstat(Fd, &Stat) == 0 && S_ISREG(Stat.st_mode) &&
+        Stat.st_size > 0 && Stat.st_size % PageSize != 0)
+    {
+        void *Data = mmap(NULL, Stat.st_size, PROT_READ, MAP_PRIVATE, Fd, 0);
+        if (Data != MAP_FAILED)
+        {
+            close(Fd);
+            Result.Data = (const char *)Data;
+            Result.Size = Stat.st_size;
+            Result.MapSize = Stat.st_size;
+            return Result;
         }
-        break;
+    }
 
-    case 3:
-        if (strcmp("def", Lexer->StringVal) == 0)
-        {
-            NextToken(Lexer);
-            if (Lexer->TokenType != TokenType_Symbol)
-            {
-                printf("error: def expecting symbol\n");
-                return true;
-            }
+    FILE *Handle = fdopen(Fd, "r");
+    if (Handle)
+    {
+        Result.Data = ReadStream(Handle, &Result.Size);
+        fclose(Handle);
+    }
+    else
+    {
+        close(Fd);
+    }
+#endif
 
-            AddDefOp(Script, Code, Lexer, OpCode_Def);
-            return true;
-        }
-        if (strcmp("set", Lexer->StringVal) == 0)
-        {
-            NextToken(Lexer);
-            if (Lexer->TokenType != TokenType_Symbol)
-            {
-                printf("error: def expecting symbol\n");
-                return true;
-            }
+    return Result;
+}
 
-            AddDefOp(Script, Code, Lexer, OpCode_Set);
-            return true;
-        }
-        break;
+static void
+FreeFileData(const char *Data, long int MapSize)
+{
+#ifndef _WIN32
+    if (MapSize)
+    {
+        munmap((void *)Data, MapSize);
+        return;
     }
+#endif
+    delete[] Data;
+}
 
-    return false;
+static void AddPoolChunk(sl_pool *Pool)
+{
+    // keep every object 16 byte aligned and big enough for the free link
+    size_t Size = (Pool->ElemSize + 15) & ~(size_t)15;
+    sl_pool_chunk *Chunk = (sl_pool_chunk *)malloc(sizeof(sl_pool_chunk) + Size*PoolChunkSize);
+    Chunk->Next = Pool->Chunks;
+    Pool->Chunks = Chunk;
+
+    // linked backwards so objects are handed out in address order
+    char *Objects = (char *)(Chunk + 1);
+    for (int i = PoolChunkSize - 1; i >= 0; --i)
+    {
+        void *Object = Objects + i*Size;
+        *(void **)Object = Pool->FirstFree;
+        Pool->FirstFree = Object;
+    }
 }
 
-static void ParseExpr(sl_script *Script, sl_code *Code, sl_lexer *Lexer, bool PopUnused)
+void *GetObject(sl_pool *Pool)
 {
-    switch (Lexer->TokenType)
+    if (!Pool->FirstFree)
     {
-    case TokenType_LeftParen:
+        AddPoolChunk(Pool);
+    }
+
+    void *Result = Pool->FirstFree;
+    Pool->FirstFree = *(void **)Result;
+#ifdef SL_DEBUG
+    printf("[DEBUG:%s] get object %p\n", Pool->DEBUGName, Result);
+#endif
+    return Result;
+}
+
+void FreeObject(sl_pool *Pool, void *Data)
+{
+#ifdef SL_DEBUG
+    printf("[DEBUG:%s] put object %p\n", Pool->DEBUGName, Data);
+#endif
+    *(void **)Data = Pool->FirstFree;
+    Pool->FirstFree = Data;
+}
+
+// young objects aren't traced, they all get promoted before sweeping
+inline void MarkObject(sl_vm *Vm, sl_object *Object)
+{
+    if (Object && Object->Pool && !Object->Young && !Object->Marked)
     {
-        NextToken(Lexer);
-        if (Lexer->TokenType == TokenType_Symbol)
-        {
-            if (ParseReserved(Script, Code, Lexer))
-            {
-                return;
-            }
-        }
+        Object->Marked = true;
+        Vm->Gray.push_back(Object);
+    }
+}
 
-        int ArgCount = 0;
-        while (Lexer->TokenType != TokenType_RightParen)
-        {
-            ParseExpr(Script, Code, Lexer);
-            ArgCount++;
-        }
-        NextToken(Lexer);
+inline sl_object *ValueObject(sl_value Value)
+{
+    switch (TypeOf(Value))
+    {
+    case ValueType_String:
+    case ValueType_NativeFunc:
+    case ValueType_Coroutine:
+    case ValueType_Closure:
+    case ValueType_Cell:
+        return (sl_object *)AsPointer(Value);
 
-        if (ArgCount > 0)
-        {
-            Emit(Code, OpCode_FuncCall, (uint8)ArgCount - 1);
-        }
-        break;
+    default:
+        return NULL;
     }
+}
 
-    case TokenType_Hash:
+inline void MarkValue(sl_vm *Vm, sl_value &Value)
+{
+    MarkObject(Vm, ValueObject(Value));
+}
+
+inline void Remember(sl_vm *Vm, sl_object *Object)
+{
+    if (!Object->Young && !Object->Remembered)
     {
-        NextToken(Lexer);
+        Object->Remembered = true;
+        Vm->Remembered.push_back(Object);
+    }
+}
 
-        sl_func *Func = new sl_func;
-        Func->StringIndex = AddString(Script, "#", 1);
-        ParseExpr(Script, &Func->Code, Lexer);
-        Emit(&Func->Code, OpCode_Return);
+// Stores into the heap or the globals while marking shade the stored value,
+// so a traced object never points to one that won't be traced. Stack slots
+// and locals don't need it, they're scanned again before sweeping. An old
+// Container that gets a young value is remembered for the next minor
+// collection, the globals (Container NULL) are always scanned by it.
+inline void WriteBarrier(sl_vm *Vm, sl_object *Container, sl_value &Value)
+{
+    if (Vm->GCPhase == GCPhase_Mark)
+    {
+        MarkValue(Vm, Value);
+    }
 
-        Script->Funcs.push_back(Func);
-        Emit(Code, OpCode_LoadFunc, (uint8)(Script->Funcs.size() - 1));
-        break;
+    sl_object *Object = ValueObject(Value);
+    if (Container && Object && Object->Young)
+    {
+        Remember(Vm, Container);
     }
+}
 
-    case TokenType_String:
+// locals of frames on the frame stack are part of the operand stack, only
+// the heap frames of coroutines have their own
+static void MarkFrame(sl_vm *Vm, sl_call_frame *Frame)
+{
+    MarkObject(Vm, Frame->Closure);
+    MarkObject(Vm, Frame->Coroutine);
+    if (Frame->Coroutine)
     {
-        int StrIndex = AddString(Script, Lexer->StringVal, Lexer->StringSize);
-        Emit(Code, OpCode_LoadString, (uint8)StrIndex);
-        NextToken(Lexer);
-        break;
+        for (int i = 0; i < Frame->Func->LocalCount; i++)
+        {
+            MarkValue(Vm, Frame->Vars[i]);
+        }
     }
+}
 
-    case TokenType_Number:
+// the operand stack (which holds the locals of every frame on the frame
+// stack) and the chain of running frames, coroutines reach their paused
+// frames through the heap
+static void MarkStack(sl_vm *Vm)
+{
+    for (int i = 0; i < Vm->StackTop; i++)
     {
-        int NumIndex = AddNumber(Script, Lexer->NumberVal);
-        Emit(Code, OpCode_LoadNumber, (uint8)NumIndex);
-        NextToken(Lexer);
+        MarkValue(Vm, Vm->Stack[i]);
+    }
+    for (sl_call_frame *Frame = Vm->CurrentFrame; Frame; Frame = Frame->Parent)
+    {
+        MarkFrame(Vm, Frame);
+    }
+}
+
+static void TraceObject(sl_vm *Vm, sl_object *Object)
+{
+    switch (Object->Type)
+    {
+    case ValueType_Closure:
+    {
+        sl_closure *Closure = (sl_closure *)Object;
+        for (int i = 0; i < Closure->Func->Captures.size(); i++)
+        {
+            MarkValue(Vm, Closure->Upvalues[i]);
+        }
         break;
     }
 
-    case TokenType_Symbol:
+    case ValueType_Cell:
+        MarkValue(Vm, ((sl_cell *)Object)->Value);
+        break;
+
+    case ValueType_Coroutine:
     {
-        if (strcmp("true", Lexer->StringVal) == 0)
+        // a paused frame's Parent is stale, only the frame itself is traced
+        sl_coroutine *Co = (sl_coroutine *)Object;
+        MarkObject(Vm, Co->Closure);
+        if (Co->Frame)
         {
-            Emit(Code, OpCode_LoadBool, 1);
+            MarkFrame(Vm, Co->Frame);
         }
-        else if (strcmp("false", Lexer->StringVal) == 0)
+        for (int i = 0; i < Co->SavedCount; i++)
         {
-            Emit(Code, OpCode_LoadBool);
+            MarkValue(Vm, Co->Saved[i]);
         }
-        else
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+static void FreeHeapObject(sl_vm *Vm, sl_object *Object)
+{
+    Vm->BytesAllocated -= Object->Size;
+    switch (Object->Type)
+    {
+    case ValueType_String:
+    {
+        sl_string *Str = (sl_string *)Object;
+        FreeFileData(Str->Value, Str->MapSize);
+        break;
+    }
+
+    case ValueType_Closure:
+        delete[] ((sl_closure *)Object)->Upvalues;
+        break;
+
+    case ValueType_Coroutine:
+    {
+        sl_coroutine *Co = (sl_coroutine *)Object;
+        if (Co->Frame)
         {
-            int StrIndex = AddString(Script, Lexer->StringVal, Lexer->StringSize);
-            Emit(Code, OpCode_LoadSymbol, (uint8)StrIndex);
+            delete[] Co->Frame->Vars;
+            delete Co->Frame;
         }
-        NextToken(Lexer);
+        delete[] Co->Saved;
         break;
     }
 
     default:
         break;
     }
+    FreeObject(Object->Pool, Object);
+}
+
+static sl_object *Promote(sl_vm *Vm, sl_object *Object);
 
-    if (PopUnused)
+// only strings and closures are ever young
+inline void ForwardValue(sl_vm *Vm, sl_value &Value)
+{
+    switch (TypeOf(Value))
     {
-        Emit(Code, OpCode_Pop);
+    case ValueType_String:
+        Value = StringValue((sl_string *)Promote(Vm, AsString(Value)));
+        break;
+
+    case ValueType_Closure:
+        Value = ClosureValue((sl_closure *)Promote(Vm, AsClosure(Value)));
+        break;
+
+    default:
+        break;
     }
 }
 
-static void DisasmCode(sl_script *Script, sl_code *Code, int Indent = 0)
+static void ForwardFrame(sl_vm *Vm, sl_call_frame *Frame)
 {
-    for (int i = 0; i < Code->Size; i += 2)
+    Frame->Closure = (sl_closure *)Promote(Vm, Frame->Closure);
+    if (Frame->Coroutine)
     {
-        sl_opcode OpCode = (sl_opcode)Code->Data[i];
-        int Arg = (int)Code->Data[i + 1];
+        for (int i = 0; i < Frame->Func->LocalCount; i++)
+        {
+            ForwardValue(Vm, Frame->Vars[i]);
+        }
+    }
+}
 
-        for (int i = 0; i < Indent; i++)
+static void ForwardChildren(sl_vm *Vm, sl_object *Object)
+{
+    switch (Object->Type)
+    {
+    case ValueType_Closure:
+    {
+        sl_closure *Closure = (sl_closure *)Object;
+        for (int i = 0; i < Closure->Func->Captures.size(); i++)
         {
-            printf("\t");
+            ForwardValue(Vm, Closure->Upvalues[i]);
         }
+        break;
+    }
 
-        printf("%d", OpCode);
-        printf("\t");
-        switch (OpCode)
+    case ValueType_Cell:
+        ForwardValue(Vm, ((sl_cell *)Object)->Value);
+        break;
+
+    case ValueType_Coroutine:
+    {
+        sl_coroutine *Co = (sl_coroutine *)Object;
+        Co->Closure = (sl_closure *)Promote(Vm, Co->Closure);
+        if (Co->Frame)
         {
-        case OpCode_Defun:
+            ForwardFrame(Vm, Co->Frame);
+        }
+        for (int i = 0; i < Co->SavedCount; i++)
         {
-            sl_func *Func = Script->Funcs[Arg];
-            printf("Defun index:%d (%s)", Arg, Script->Strings[Func->StringIndex].Value);
-            break;
+            ForwardValue(Vm, Co->Saved[i]);
         }
+        break;
+    }
 
-        case OpCode_Def:
-            printf("Def index:%d (%s)", Arg, Script->Strings[Arg].Value);
-            break;
+    default:
+        break;
+    }
+}
 
-        case OpCode_Defonce:
-            printf("Defonce index:%d (%s)", Arg, Script->Strings[Arg].Value);
-            break;
+// Copies a young object into its pool the first time it's reached, the
+// contents it kept inline get their own allocation. The copy is gray while
+// marking, it may point to objects only young ones pointed to before.
+static sl_object *Promote(sl_vm *Vm, sl_object *Object)
+{
+    if (!Object || !Object->Young)
+    {
+        return Object;
+    }
+    if (Object->Next)
+    {
+        return Object->Next;
+    }
 
-        case OpCode_Set:
-            printf("Set index:%d (%s)", Arg, Script->Strings[Arg].Value);
-            break;
+    sl_object *Copy = (sl_object *)GetObject(Object->Pool);
+    switch (Object->Type)
+    {
+    case ValueType_String:
+    {
+        sl_string *Young = (sl_string *)Object;
+        sl_string *Str = (sl_string *)Copy;
+        Str->Size = Young->Size;
+        Str->Hash = Young->Hash;
+        Str->Value = new char[Young->Size + 1];
+        Str->MapSize = 0;
+        memcpy(Str->Value, Young->Value, Young->Size + 1);
+        break;
+    }
 
-        case OpCode_FuncCall:
-            printf("FuncCall args:%d", Arg);
-            break;
+    case ValueType_Closure:
+    {
+        sl_closure *Young = (sl_closure *)Object;
+        sl_closure *Closure = (sl_closure *)Copy;
+        int Count = Young->Func->Captures.size();
+        Closure->Func = Young->Func;
+        Closure->Upvalues = new sl_value[Count];
+        for (int i = 0; i < Count; i++)
+        {
+            Closure->Upvalues[i] = Young->Upvalues[i];
+        }
+        break;
+    }
 
-        case OpCode_LoadBool:
-            printf("LoadBool %d", Arg);
-            break;
+    default:
+        break;
+    }
 
-        case OpCode_LoadString:
-            printf("LoadString index:%d (%s)", Arg, Script->Strings[Arg].Value);
-            break;
+    Copy->Next = Vm->Objects;
+    Copy->Pool = Object->Pool;
+    Copy->Size = Object->Size;
+    Copy->Type = Object->Type;
+    Copy->Marked = false;
+    Copy->Young = false;
+    Copy->Remembered = false;
+    Vm->Objects = Copy;
+    Vm->BytesAllocated += Copy->Size;
+    if (Vm->GCPhase == GCPhase_Mark)
+    {
+        MarkObject(Vm, Copy);
+    }
+
+    Object->Next = Copy;
+    Vm->Promoted.push_back(Copy);
+    return Copy;
+}
+
+// Promotes every young object reachable from the stack, the running frames,
+// the globals or a remembered object, then empties the nursery in one go.
+// Young objects never own anything outside the nursery, so the dead ones
+// need no freeing.
+static void MinorCollect(sl_vm *Vm)
+{
+    for (int i = 0; i < Vm->StackTop; i++)
+    {
+        ForwardValue(Vm, Vm->Stack[i]);
+    }
+    for (sl_call_frame *Frame = Vm->CurrentFrame; Frame; Frame = Frame->Parent)
+    {
+        ForwardFrame(Vm, Frame);
+    }
+    for (int i = 0; i < Vm->GlobalCount; i++)
+    {
+        ForwardValue(Vm, Vm->Globals[i]);
+    }
 
-        case OpCode_LoadNumber:
-            printf("LoadNumber index:%d (%.4f)", Arg, Script->Numbers[Arg]);
-            break;
+    for (sl_object *Object : Vm->Remembered)
+    {
+        Object->Remembered = false;
+        ForwardChildren(Vm, Object);
+    }
+    Vm->Remembered.clear();
 
-        case OpCode_LoadSymbol:
-            printf("LoadSymbol index:%d (%s)", Arg, Script->Strings[Arg].Value);
-            break;
+    while (!Vm->Promoted.empty())
+    {
+        sl_object *Object = Vm->Promoted.back();
+        Vm->Promoted.pop_back();
+        ForwardChildren(Vm, Object);
+    }
 
-        case OpCode_LoadFunc:
-            printf("LoadFunc index:%d", Arg);
-            break;
+    Vm->NurseryTop = 0;
+    Vm->GCStats.MinorCycles++;
+}
 
-        case OpCode_Return:
-            printf("Return");
-            break;
+// Tri-color marking: Marked objects on Gray are gray, the other Marked ones
+// black. A cycle marks the roots, traces Work objects per step, then scans
+// the stack again and sweeps Work objects per step. The globals are only
+// scanned at the start, stores to them go through WriteBarrier.
+static void GCStep(sl_vm *Vm, int Work)
+{
+    switch (Vm->GCPhase)
+    {
+    case GCPhase_Idle:
+        for (int i = 0; i < Vm->GlobalCount; i++)
+        {
+            MarkValue(Vm, Vm->Globals[i]);
+        }
+        MarkStack(Vm);
+        Vm->GCPhase = GCPhase_Mark;
+        break;
 
-        case OpCode_Pop:
-            printf("Pop");
+    case GCPhase_Mark:
+        while (Work-- > 0 && !Vm->Gray.empty())
+        {
+            sl_object *Object = Vm->Gray.back();
+            Vm->Gray.pop_back();
+            TraceObject(Vm, Object);
+        }
 
-            if (Code->Data[i+2] == OpCode_Return)
+        if (Vm->Gray.empty())
+        {
+            // nothing young is left to point to an unmarked object, and
+            // nothing remembered can be swept
+            MinorCollect(Vm);
+            MarkStack(Vm);
+            while (!Vm->Gray.empty())
             {
-                printf(" (noop)");
+                sl_object *Object = Vm->Gray.back();
+                Vm->Gray.pop_back();
+                TraceObject(Vm, Object);
             }
-            break;
 
-        case OpCode_Halt:
-            printf("Halt");
-            break;
+            // objects allocated from here on go on the new list unmarked
+            Vm->SweepList = Vm->Objects;
+            Vm->Objects = NULL;
+            Vm->GCPhase = GCPhase_Sweep;
         }
+        break;
 
-        printf("\n");
+    case GCPhase_Sweep:
+        while (Work-- > 0 && Vm->SweepList)
+        {
+            sl_object *Object = Vm->SweepList;
+            Vm->SweepList = Object->Next;
+            if (Object->Marked)
+            {
+                Object->Marked = false;
+                Object->Next = Vm->Objects;
+                Vm->Objects = Object;
+            }
+            else
+            {
+                FreeHeapObject(Vm, Object);
+            }
+        }
+
+        if (!Vm->SweepList)
+        {
+            Vm->NextCollection = (size_t)(Vm->BytesAllocated*Vm->GCGrowth);
+            if (Vm->NextCollection < Vm->GCMinHeap)
+            {
+                Vm->NextCollection = Vm->GCMinHeap;
+            }
+            Vm->GCPhase = GCPhase_Idle;
+            Vm->GCStats.Cycles++;
+#ifdef SL_DEBUG
+            printf("[DEBUG:GC] %zu bytes live, next collection at %zu\n",
+                   Vm->BytesAllocated, Vm->NextCollection);
+#endif
+        }
+        break;
     }
 }
 
-void Disasm(sl_script *Script)
+static void RecordPause(sl_vm *Vm, double Seconds)
 {
-    printf("simple_lisp:\t%s\n\n", Script->Filename);
-    printf("strings:\t");
-    for (auto &Str : Script->Strings)
+    sl_gc_stats *Stats = &Vm->GCStats;
+    int Bucket = 0;
+    double Micros = Seconds*1e6;
+    while (Bucket < GCPauseBuckets - 1 && Micros >= (double)(1 << Bucket))
     {
-        printf("%s ", Str.Value);
+        Bucket++;
     }
-    printf("\n\n");
 
-    printf("numbers:\t");
-    for (float Num : Script->Numbers)
+    Stats->Pauses[Bucket]++;
+    Stats->PauseCount++;
+    Stats->TotalPause += Seconds;
+    if (Seconds > Stats->MaxPause)
     {
-        printf("%.4f ", Num);
+        Stats->MaxPause = Seconds;
     }
-    printf("\n\n");
+}
 
-    printf("funcs:\n");
-    for (auto Func : Script->Funcs)
+// runs a whole collection, finishing the one in progress first if any
+void CollectGarbage(sl_vm *Vm)
+{
+    auto Start = std::chrono::steady_clock::now();
+    while (Vm->GCPhase != GCPhase_Idle)
+    {
+        GCStep(Vm, INT32_MAX);
+    }
+    do
     {
-        printf("\t%s code (%d):\n", Script->Strings[Func->StringIndex].Value, Func->Code.Size/2);
+        GCStep(Vm, INT32_MAX);
+    } while (Vm->GCPhase != GCPhase_Idle);
+    RecordPause(Vm, std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count());
+}
 
-        DisasmCode(Script, &Func->Code, 2);
-        printf("\n");
+#ifdef SL_PROFILE_OPCODES
+// prints the Count most frequent pairs of consecutive opcodes
+void PrintOpCodeProfile(sl_vm *Vm, int Count = 30)
+{
+    uint64_t Total = 0;
+    std::vector<int> Pairs;
+    for (int i = 0; i < OpCodeCount*OpCodeCount; i++)
+    {
+        if (Vm->OpCodePairs[i / OpCodeCount][i % OpCodeCount])
+        {
+            Total += Vm->OpCodePairs[i / OpCodeCount][i % OpCodeCount];
+            Pairs.push_back(i);
+        }
     }
-    printf("\n");
+    std::sort(Pairs.begin(), Pairs.end(), [Vm](int A, int B)
+    {
+        return Vm->OpCodePairs[A / OpCodeCount][A % OpCodeCount] > Vm->OpCodePairs[B / OpCodeCount][B % OpCodeCount];
+    });
 
-    printf("code (%d):\n", Script->Code.Size/2);
-    DisasmCode(Script, &Script->Code);
+    printf("opcode pairs: %llu instructions\n", (unsigned long long)Total);
+    for (int i = 0; i < Count && i < Pairs.size(); i++)
+    {
+        uint64_t Pair = Vm->OpCodePairs[Pairs[i] / OpCodeCount][Pairs[i] % OpCodeCount];
+        printf("  %5.2f%%  %-12s %-12s %llu\n", Pair*100.0/Total, OpCodeNames[Pairs[i] / OpCodeCount],
+               OpCodeNames[Pairs[i] % OpCodeCount], (unsigned long long)Pair);
+    }
 }
+#endif
 
-void CompileScript(sl_script *Script, const char *Source)
+const sl_gc_stats *GetGCStats(sl_vm *Vm)
 {
-    sl_lexer Lexer;
-    InitLexer(&Lexer, Source);
+    return &Vm->GCStats;
+}
 
-    while (Lexer.TokenType != TokenType_EOF)
+void PrintGCStats(sl_vm *Vm)
+{
+    sl_gc_stats *Stats = &Vm->GCStats;
+    printf("gc: %llu cycles, %llu minor, %llu pauses, total %.3f ms, max %.3f ms\n",
+           (unsigned long long)Stats->Cycles, (unsigned long long)Stats->MinorCycles,
+           (unsigned long long)Stats->PauseCount,
+           Stats->TotalPause*1000.0, Stats->MaxPause*1000.0);
+    for (int i = 0; i < GCPauseBuckets; i++)
     {
-        ParseExpr(Script, &Script->Code, &Lexer, true);
+        if (Stats->Pauses[i])
+        {
+            printf("  %s %7dus: %llu\n", i == GCPauseBuckets - 1 ? ">=" : " <",
+                   i == GCPauseBuckets - 1 ? 1 << (i - 1) : 1 << i,
+                   (unsigned long long)Stats->Pauses[i]);
+        }
     }
-    Emit(&Script->Code, OpCode_Halt);
 }
 
-void *GetObject(sl_pool *Pool)
+// Objects are allocated black while marking, they can only point to things
+// that were on the stack or went through WriteBarrier.
+static sl_object *AllocObject(sl_vm *Vm, sl_pool *Pool, sl_value_type Type, size_t Size)
 {
-    if (Pool->FirstFree)
+    if (Vm->GCPhase != GCPhase_Idle || Vm->BytesAllocated + Size > Vm->NextCollection)
     {
-        sl_pool_entry *Result = Pool->FirstFree;
-        Pool->FirstFree = Result->Next;
-
-#ifdef SL_DEBUG
-        printf("[DEBUG:%s] reuse object %p\n", Pool->DEBUGName, Result->Data);
-#endif
-        return Result->Data;
+        auto Start = std::chrono::steady_clock::now();
+        GCStep(Vm, Vm->GCStepWork);
+        RecordPause(Vm, std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count());
     }
 
-    sl_pool_entry *Entry = new sl_pool_entry;
-    Entry->Next = Pool->First;
-    Pool->First = Entry;
-    Entry->Data = malloc(Pool->ElemSize);
-#ifdef SL_DEBUG
-    printf("[DEBUG:%s] alloc object %p\n", Pool->DEBUGName, Entry->Data);
-#endif
-    return Entry->Data;
+    sl_object *Object = (sl_object *)GetObject(Pool);
+    Object->Next = Vm->Objects;
+    Object->Pool = Pool;
+    Object->Size = Size;
+    Object->Type = Type;
+    Object->Marked = Vm->GCPhase == GCPhase_Mark;
+    Object->Young = false;
+    Object->Remembered = false;
+    Vm->Objects = Object;
+    Vm->BytesAllocated += Size;
+    return Object;
 }
 
-void FreeObject(sl_pool *Pool, void *Data)
+// Bump allocates an object of Size bytes in the nursery, running a minor
+// collection first if it's full. Returns NULL when there's no nursery or the
+// object would take too much of it, callers then use AllocObject.
+static sl_object *AllocYoung(sl_vm *Vm, sl_pool *Pool, sl_value_type Type, size_t Size)
 {
-    sl_pool_entry *Entry = Pool->First;
-    sl_pool_entry *Prev = NULL;
+    size_t Footprint = (Size + 15) & ~(size_t)15;
+    if (Footprint > Vm->NurserySize/4)
+    {
+        return NULL;
+    }
 
-    while (Entry)
+    if (Vm->NurseryTop + Footprint > Vm->NurserySize)
     {
-        if (Entry->Data == Data)
+        // the promoted bytes count towards the next major collection, which
+        // also has to make progress when everything is allocated young
+        auto Start = std::chrono::steady_clock::now();
+        MinorCollect(Vm);
+        if (Vm->GCPhase != GCPhase_Idle || Vm->BytesAllocated > Vm->NextCollection)
         {
-            sl_pool_entry *Next = Entry->Next;
-            Entry->Next = Pool->FirstFree;
-            if (Prev)
-            {
-                Prev->Next = Next;
-            }
-#ifdef SL_DEBUG
-            printf("[DEBUG:%s] put object %p\n", Pool->DEBUGName, Data);
-#endif
-            Pool->FirstFree = Entry;
-            break;
+            GCStep(Vm, Vm->GCStepWork);
         }
-
-        Prev = Entry;
-        Entry = Entry->Next;
+        RecordPause(Vm, std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count());
     }
+
+    sl_object *Object = (sl_object *)(Vm->Nursery + Vm->NurseryTop);
+    Vm->NurseryTop += Footprint;
+    Object->Next = NULL;
+    Object->Pool = Pool;
+    Object->Size = Size;
+    Object->Type = Type;
+    Object->Marked = false;
+    Object->Young = true;
+    Object->Remembered = false;
+    return Object;
 }
 
-inline void IncRef(sl_value &Value)
+// the string owns Value, which must come from new[] or from ReadFile
+inline sl_value CreateString(sl_vm *Vm, char *Value, int64_t Size)
 {
-    switch (Value.Type)
-    {
-    case ValueType_String:
-        Value.String->RefCount++;
-        break;
+    sl_string *Str = (sl_string *)AllocObject(Vm, &Vm->StringPool, ValueType_String,
+                                              sizeof(sl_string) + Size);
+    Str->Value = Value;
+    Str->Size = Size;
+    Str->MapSize = 0;
 
-    default:
-        break;
+    return StringValue(Str);
+}
+
+// a string of Size bytes for the caller to fill, with the terminator already
+// in place
+inline sl_value AllocString(sl_vm *Vm, int64_t Size)
+{
+    sl_string *Str = (sl_string *)AllocYoung(Vm, &Vm->StringPool, ValueType_String,
+                                             sizeof(sl_string) + Size + 1);
+    if (Str)
+    {
+        Str->Value = (char *)(Str + 1);
+    }
+    else
+    {
+        Str = (sl_string *)AllocObject(Vm, &Vm->StringPool, ValueType_String,
+                                       sizeof(sl_string) + Size);
+        Str->Value = new char[Size + 1];
     }
+    Str->Size = Size;
+    Str->Hash = 0;
+    Str->MapSize = 0;
+    Str->Value[Size] = 0;
+
+    return StringValue(Str);
 }
 
-inline void DecRef(sl_value &Value)
+// Makes room for Count more values above StackTop. Stack frames point into the
+// stack, so they get moved along with it; natives holding Args have to fetch
+// them again after anything that can call this.
+static void EnsureStack(sl_vm *Vm, int Count)
 {
-    sl_ref *Ref = NULL;
-    switch (Value.Type)
+    int Needed = Vm->StackTop + Count;
+    if (Needed <= Vm->StackSize)
     {
-    case ValueType_String:
-        Ref = Value.String;
-        break;
+        return;
+    }
+    if (Needed > StackLimit)
+    {
+        printf("error: stack overflow\n");
+        exit(EXIT_FAILURE);
+    }
 
-    default:
-        break;
+    int Size = Vm->StackSize ? Vm->StackSize : InitialStackSize;
+    while (Size < Needed)
+    {
+        Size *= 2;
     }
 
-    if (Ref)
+    sl_value *Stack = (sl_value *)malloc(Size*sizeof(sl_value));
+    if (Vm->Stack)
     {
-        Ref->RefCount--;
-        if (Ref->RefCount <= 0)
-        {
-            Ref->RefCount = 0;
-            if (Ref->Pool)
-            {
-                FreeObject(Ref->Pool, Ref);
-            }
-        }
+        memcpy(Stack, Vm->Stack, Vm->StackTop*sizeof(sl_value));
+    }
+    for (int i = 0; i < Vm->FrameTop; i++)
+    {
+        Vm->Frames[i].Vars = Stack + (Vm->Frames[i].Vars - Vm->Stack);
     }
+    free(Vm->Stack);
+    Vm->Stack = Stack;
+    Vm->StackSize = Size;
 }
 
-inline void InitRef(sl_ref *Ref, sl_pool *Pool)
+// Calls Func with the top ArgCount values of the stack as its arguments, a
+// frame off the frame stack adopts them in place and its result replaces the
+// callee below them.
+inline void PushCallFrame(sl_vm *Vm, sl_func *Func, sl_closure *Closure = NULL,
+                          sl_coroutine *Co = NULL, int ArgCount = 0)
 {
-    Ref->RefCount = 0;
-    Ref->Pool = Pool;
-}
+    sl_call_frame *Frame;
+    int Adopted = ArgCount < Func->ArgCount ? ArgCount : Func->ArgCount;
+    if (Co)
+    {
+        Frame = new sl_call_frame;
+        Frame->Vars = new sl_value[Func->LocalCount];
+
+        // owned by the coroutine from now on
+        uint32 Size = sizeof(sl_call_frame) + Func->LocalCount*sizeof(sl_value);
+        Co->Size += Size;
+        Vm->BytesAllocated += Size;
+        for (int i = 0; i < Adopted; i++)
+        {
+            Frame->Vars[i] = Vm->Stack[Vm->StackTop - ArgCount + i];
+        }
 
-inline sl_value CreateNumber(float Number)
-{
-    sl_value Result;
-    Result.Type = ValueType_Number;
-    Result.Number = Number;
-    return Result;
-}
+        Frame->Base = Vm->StackTop - ArgCount;
+        Vm->Stack[Frame->Base] = sl_value{};
+        Vm->StackTop = Frame->Base + 1;
+        EnsureStack(Vm, Func->MaxStack);
+    }
+    else
+    {
+        if (Vm->FrameTop == MaxFrames)
+        {
+            printf("error: stack overflow\n");
+            exit(EXIT_FAILURE);
+        }
 
-inline sl_value CreateBool(bool Value)
-{
-    sl_value Result;
-    Result.Type = ValueType_Bool;
-    Result.Bool = Value;
-    return Result;
+        // the one check for everything the call pushes
+        EnsureStack(Vm, Func->LocalCount + Func->MaxStack);
+        Frame = &Vm->Frames[Vm->FrameTop++];
+        Frame->Base = Vm->StackTop - ArgCount - 1;
+        Frame->Vars = Vm->Stack + Frame->Base + 1;
+        for (int i = Adopted; i < Func->LocalCount; i++)
+        {
+            Frame->Vars[i] = sl_value{};
+        }
+        Vm->StackTop = Frame->Base + 1 + Func->LocalCount;
+    }
+    Frame->StackBase = Vm->StackTop;
+    Frame->CodePtr = Func->Code.Data;
+    Frame->Func = Func;
+    Frame->Closure = Closure;
+    Frame->Parent = Vm->CurrentFrame;
+    Frame->Coroutine = Co;
+    Vm->CurrentFrame = Frame;
 }
 
-inline sl_value CreateString(sl_vm *Vm, char *Value, int Size)
+// frames not belonging to a coroutine are always the top of the frame stack
+inline void FreeCallFrame(sl_vm *Vm, sl_call_frame *Frame)
 {
-    sl_string *Str = (sl_string *)GetObject(&Vm->StringPool);
-    InitRef(Str, &Vm->StringPool);
-    Str->Value = Value;
-    Str->Size = Size;
+    if (Frame->Coroutine)
+    {
+        uint32 Size = sizeof(sl_call_frame) + Frame->Func->LocalCount*sizeof(sl_value);
+        Frame->Coroutine->Size -= Size;
+        Vm->BytesAllocated -= Size;
 
-    sl_value Result;
-    Result.Type = ValueType_String;
-    Result.String = Str;
-    return Result;
+        delete[] Frame->Vars;
+        delete Frame;
+    }
+    else
+    {
+        Vm->FrameTop--;
+    }
 }
 
-inline sl_value CreateCustom(void *Custom)
+// the value of the function running in Frame, what LoadSelf pushes
+inline sl_value FrameCallee(sl_call_frame *Frame)
 {
-    sl_value Result;
-    Result.Type = ValueType_Custom;
-    Result.Custom = Custom;
-    return Result;
+    return Frame->Closure ? ClosureValue(Frame->Closure) : FuncValue(Frame->Func);
 }
 
-inline void PushCallFrame(sl_vm *Vm, uint8 *Code, sl_coroutine *Co = NULL)
+inline sl_value CreateFunc(sl_vm *Vm, sl_func *Func, sl_call_frame *Frame)
 {
-    sl_call_frame *Frame = new sl_call_frame;
-    Frame->CodePtr = Code;
-    Frame->Parent = Vm->CurrentFrame;
-    Frame->Coroutine = Co;
-    Vm->CurrentFrame = Frame;
+    if (Func->Captures.empty())
+    {
+        return FuncValue(Func);
+    }
+
+    uint32 Size = sizeof(sl_closure) + Func->Captures.size()*sizeof(sl_value);
+    sl_closure *Closure = (sl_closure *)AllocYoung(Vm, &Vm->ClosurePool, ValueType_Closure, Size);
+    if (Closure)
+    {
+        // the upvalues follow the closure in the nursery
+        Closure->Upvalues = (sl_value *)(Closure + 1);
+    }
+    else
+    {
+        Closure = (sl_closure *)AllocObject(Vm, &Vm->ClosurePool, ValueType_Closure, Size);
+        Closure->Upvalues = new sl_value[Func->Captures.size()];
+    }
+    // the captured slots and upvalues hold cells, the closure shares them
+    Closure->Func = Func;
+    for (int i = 0; i < Func->Captures.size(); i++)
+    {
+        sl_capture &Capture = Func->Captures[i];
+        if (Capture.Type == VarType_Local)
+        {
+            Closure->Upvalues[i] = Frame->Vars[Capture.Index];
+        }
+        else
+        {
+            Closure->Upvalues[i] = Frame->Closure->Upvalues[Capture.Index];
+        }
+        WriteBarrier(Vm, Closure, Closure->Upvalues[i]);
+    }
+
+    return ClosureValue(Closure);
 }
 
+// room is made on function entry, see ComputeMaxStack
 inline void StackPush(sl_vm *Vm, sl_value Value)
 {
+#ifdef SL_DEBUG
+    assert(Vm->StackTop < Vm->StackSize);
+#endif
     Vm->Stack[Vm->StackTop++] = Value;
 }
 
@@ -909,208 +4453,551 @@ inline sl_value StackPop(sl_vm *Vm)
     return sl_value{};
 }
 
+static uint32 GlobalVersionCounter = 0;
+
+// returns the slot of the global Name, a nil slot is added the first time a
+// name is seen
+static int GlobalId(sl_vm *Vm, const char *Name, int Size)
+{
+    int Id = InternString(Vm->GlobalNames, &Vm->GlobalTable, Name, Size);
+    if (Id < Vm->GlobalCount)
+    {
+        return Id;
+    }
+
+    if (Id >= Vm->GlobalCapacity)
+    {
+        int Capacity = Vm->GlobalCapacity ? Vm->GlobalCapacity*2 : 64;
+        sl_value *Globals = new sl_value[Capacity];
+        for (int i = 0; i < Vm->GlobalCount; i++)
+        {
+            Globals[i] = Vm->Globals[i];
+        }
+        delete[] Vm->Globals;
+        Vm->Globals = Globals;
+        Vm->GlobalCapacity = Capacity;
+
+        // the counter is shared by every vm so a site cached by another vm
+        // never looks valid here
+        Vm->GlobalVersion = ++GlobalVersionCounter;
+    }
+    Vm->GlobalCount = Id + 1;
+    return Id;
+}
+
+// looks up the slot of a global access site, only touching the name the first
+// time or after the global array moved
+inline sl_value *GlobalSlot(sl_vm *Vm, sl_script *Script, uint32 Index)
+{
+    sl_global_site *Site = &Script->GlobalSites[Index];
+    if (Site->Version != Vm->GlobalVersion)
+    {
+        sl_string &Name = Script->Strings[Site->StringIndex];
+        int Id = GlobalId(Vm, Name.Value, (int)Name.Size);
+        Site->Slot = &Vm->Globals[Id];
+        Site->Version = Vm->GlobalVersion;
+    }
+    return Site->Slot;
+}
+
 void RegisterNativeFunc(sl_vm *Vm, const std::string &Name, native_func *Func, void *Data)
 {
-    sl_value Value;
-    Value.Type = ValueType_NativeFunc;
-    Value.Native = new sl_native;
-    Value.Native->Func = Func;
-    Value.Native->Data = Data;
-    Vm->Globals[Name] = Value;
+    sl_native *Native = (sl_native *)AllocObject(Vm, &Vm->NativePool, ValueType_NativeFunc,
+                                                 sizeof(sl_native));
+    Native->Func = Func;
+    Native->Data = Data;
+    int Id = GlobalId(Vm, Name.c_str(), Name.size());
+    Vm->Globals[Id] = NativeValue(Native);
+    WriteBarrier(Vm, NULL, Vm->Globals[Id]);
 }
 
-void Execute(sl_vm *Vm, sl_script *Script, sl_code *Code, bool StopOnReturn = false, sl_coroutine *Co = NULL)
+NATIVE_FUNC(Add);
+NATIVE_FUNC(Sub);
+NATIVE_FUNC(Mul);
+NATIVE_FUNC(Div);
+NATIVE_FUNC(Lt);
+NATIVE_FUNC(Gt);
+NATIVE_FUNC(Eq);
+
+// Threaded dispatch ends every handler with its own jump through a table of
+// label addresses, instead of going back to a single switch, so each opcode
+// gets its own entry in the branch predictor. It needs the labels as values
+// extension of GCC and Clang, SL_SWITCH_DISPATCH forces the switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(SL_SWITCH_DISPATCH)
+#define SL_THREADED_DISPATCH
+#endif
+
+// The hot registers of the interpreter (code pointer, stack top, locals of
+// the frame) are kept in locals of Execute. VM_SAVE writes them back before
+// anything that reads them from the vm: calls, allocations and yields.
+// VM_LOAD reads them again after, the frame may have changed or the stack
+// moved.
+#define VM_SAVE() (Frame->CodePtr = Ip, Vm->StackTop = (int)(Sp - Vm->Stack))
+#define VM_LOAD() (Frame = Vm->CurrentFrame, Ip = Frame->CodePtr, \
+                   Sp = Vm->Stack + Vm->StackTop, Vars = Frame->Vars)
+#define VM_POP() (*--Sp)
+#ifdef SL_DEBUG
+#define VM_PUSH(Value) (assert(Sp < Vm->Stack + Vm->StackSize), *Sp++ = (Value))
+#else
+#define VM_PUSH(Value) (*Sp++ = (Value))
+#endif
+
+#ifdef SL_PROFILE_OPCODES
+#define VM_PROFILE() \
+    if (OpCode != OpCode_Wide) \
+    { \
+        Vm->OpCodePairs[Vm->LastOpCode][OpCode]++; \
+        Vm->LastOpCode = OpCode; \
+    }
+#else
+#define VM_PROFILE()
+#endif
+
+#ifdef SL_THREADED_DISPATCH
+#define VM_CASE(Name) Op_##Name
+#define VM_NEXT() \
+    do \
+    { \
+        OpCode = Ip[0]; \
+        Arg = Ip[1]; \
+        Ip += 2; \
+        VM_PROFILE(); \
+        goto *DispatchTable[OpCode]; \
+    } while (0)
+#else
+#define VM_CASE(Name) case OpCode_##Name
+#define VM_NEXT() continue
+#endif
+
+// fast path of the operator opcodes, taken when both operands are numbers and
+// the operator is still the builtin, otherwise the operator is called with
+// the two operands like a FuncCall
+#define BINARY_OP(Builtin, Result) \
+    { \
+        sl_value Op = *GlobalSlot(Vm, Script, Arg); \
+        sl_value &A = Sp[-2]; \
+        sl_value &B = Sp[-1]; \
+        if (IsNumber(A) && IsNumber(B) && \
+            Is(Op, NativeFunc) && AsNative(Op)->Func == Builtin) \
+        { \
+            A = Result; \
+            Sp--; \
+            VM_NEXT(); \
+        } \
+        sl_value Lhs = A; \
+        sl_value Rhs = B; \
+        Sp -= 2; \
+        VM_PUSH(Op); \
+        VM_PUSH(Lhs); \
+        VM_PUSH(Rhs); \
+        Arg = 2; \
+        goto call; \
+    }
+
+// Register operators write their result to a local or the stack, the generic
+// call leaves it on the stack for the StoreLocal that follows. Locals and
+// immediates are picked by address rather than by branching on their kind,
+// every site of the opcode shares that branch so it would predict badly.
+#define REGISTER(Operand) \
+    ((Operand) < RegImmediate ? Vars : Vm->RegisterImmediates - RegImmediate)[Operand]
+
+// takes or skips the JumpIfFalse after a register operator, it's always wide
+#define REGISTER_BRANCH(Result) \
+    if (IsFalse(Result)) \
+    { \
+        Ip = Frame->Func->Code.Data + \
+             ((uint32)Ip[2] | ((uint32)Ip[3] << 8) | ((uint32)Ip[4] << 16) | ((uint32)Ip[5] << 24)); \
+    } \
+    else \
+    { \
+        Ip += 6; \
+    }
+
+#define REGISTER_OP(Builtin, Result, LoadA) \
+    { \
+        sl_value Op = *GlobalSlot(Vm, Script, Arg); \
+        sl_value A = LoadA; \
+        sl_value B = REGISTER(Ip[1]); \
+        uint8 Dst = Ip[2]; \
+        Ip += 3; \
+        if (IsNumber(A) && IsNumber(B) && \
+            Is(Op, NativeFunc) && AsNative(Op)->Func == Builtin) \
+        { \
+            if (Dst == RegStack) \
+            { \
+                VM_PUSH(Result); \
+            } \
+            else if (Dst == RegBranch) \
+            { \
+                REGISTER_BRANCH(Result); \
+            } \
+            else \
+            { \
+                Vars[Dst] = Result; \
+                Ip += 2; \
+            } \
+            VM_NEXT(); \
+        } \
+        VM_PUSH(Op); \
+        VM_PUSH(A); \
+        VM_PUSH(B); \
+        Arg = 2; \
+        goto call; \
+    }
+
+// Runs Func until its frame returns, or until it yields when it's the body of
+// the coroutine Co.
+void Execute(sl_vm *Vm, sl_script *Script, sl_func *Func, sl_closure *Closure = NULL,
+             sl_coroutine *Co = NULL, int ArgCount = 0)
 {
     if (Co && Co->Frame)
     {
+        Co->Frame->Parent = Vm->CurrentFrame;
         Vm->CurrentFrame = Co->Frame;
     }
     else
     {
-        PushCallFrame(Vm, Code->Data, Co);
+        PushCallFrame(Vm, Func, Closure, Co, ArgCount);
     }
+
+    sl_call_frame *EntryFrame = Vm->CurrentFrame;
+    sl_call_frame *Frame;
+    uint8 *Ip;
+    sl_value *Sp;
+    sl_value *Vars;
+    uint32 Arg;
+    uint8 OpCode;
+    VM_LOAD();
+
+#ifdef SL_THREADED_DISPATCH
+    // in sl_opcode order
+    static const void *DispatchTable[] = {
+        &&Op_Halt, &&Op_FuncCall, &&Op_TailCall, &&Op_LoadNil, &&Op_LoadBool, &&Op_LoadString,
+        &&Op_LoadNumber, &&Op_LoadFixnum, &&Op_LoadLocal, &&Op_LoadUpvalue,
+        &&Op_LoadCell, &&Op_LoadGlobal, &&Op_LoadSelf, &&Op_LoadFunc, &&Op_StoreLocal,
+        &&Op_StoreUpvalue, &&Op_StoreCell, &&Op_StoreGlobal, &&Op_DefonceLocal,
+        &&Op_DefonceCell, &&Op_DefonceGlobal, &&Op_MakeCell, &&Op_Return, &&Op_Pop, &&Op_Jump, &&Op_JumpIfFalse, &&Op_Add, &&Op_Sub,
+        &&Op_Mul, &&Op_Div, &&Op_Lt, &&Op_Gt, &&Op_Eq, &&Op_AddRR, &&Op_SubRR,
+        &&Op_MulRR, &&Op_DivRR, &&Op_LtRR, &&Op_GtRR, &&Op_EqRR, &&Op_AddSR,
+        &&Op_SubSR, &&Op_MulSR, &&Op_DivSR, &&Op_LtSR, &&Op_GtSR, &&Op_EqSR,
+        &&Op_Wide,
+    };
+    static_assert(sizeof(DispatchTable)/sizeof(DispatchTable[0]) == OpCode_Wide + 1,
+                  "DispatchTable is missing opcodes");
+
+    VM_NEXT();
+#else
     for (;;)
     {
-        sl_call_frame *Frame = Vm->CurrentFrame;
-        sl_opcode OpCode = (sl_opcode)*Frame->CodePtr++;
-        int Arg = (int)*Frame->CodePtr++;
+        OpCode = Ip[0];
+        Arg = Ip[1];
+        Ip += 2;
+        VM_PROFILE();
+
+    dispatch:
+        switch (OpCode)
+        {
+#endif
+        VM_CASE(StoreLocal):
+        {
+            Vars[Arg] = VM_POP();
+            VM_NEXT();
+        }
+
+        VM_CASE(DefonceLocal):
+        {
+            sl_value Value = VM_POP();
+            if (Is(Vars[Arg], Nil))
+            {
+                Vars[Arg] = Value;
+            }
+            VM_NEXT();
+        }
+
+        VM_CASE(StoreUpvalue):
+        {
+            sl_cell *Cell = AsCell(Frame->Closure->Upvalues[Arg]);
+            Cell->Value = VM_POP();
+            WriteBarrier(Vm, Cell, Cell->Value);
+            VM_NEXT();
+        }
+
+        VM_CASE(StoreCell):
+        {
+            sl_cell *Cell = AsCell(Vars[Arg]);
+            Cell->Value = VM_POP();
+            WriteBarrier(Vm, Cell, Cell->Value);
+            VM_NEXT();
+        }
+
+        VM_CASE(DefonceCell):
+        {
+            sl_value Value = VM_POP();
+            sl_cell *Cell = AsCell(Vars[Arg]);
+            if (Is(Cell->Value, Nil))
+            {
+                Cell->Value = Value;
+                WriteBarrier(Vm, Cell, Cell->Value);
+            }
+            VM_NEXT();
+        }
 
-        switch (OpCode)
+        VM_CASE(MakeCell):
         {
-        case OpCode_Def:
+            // allocating can collect, which scans the stack
+            VM_SAVE();
+            sl_cell *Cell = (sl_cell *)AllocObject(Vm, &Vm->CellPool, ValueType_Cell, sizeof(sl_cell));
+            Cell->Value = Vars[Arg];
+            WriteBarrier(Vm, Cell, Cell->Value);
+            Vars[Arg] = CellValue(Cell);
+            VM_NEXT();
+        }
+
+        VM_CASE(StoreGlobal):
         {
-            Frame->Vars[Arg] = StackPop(Vm);
-            break;
+            sl_value *Global = GlobalSlot(Vm, Script, Arg);
+            *Global = VM_POP();
+            WriteBarrier(Vm, NULL, *Global);
+            VM_NEXT();
         }
 
-        case OpCode_Defonce:
+        VM_CASE(DefonceGlobal):
         {
-            if (Frame->Vars[Arg].Type == ValueType_Nil)
+            sl_value Value = VM_POP();
+            sl_value &Global = *GlobalSlot(Vm, Script, Arg);
+            if (Is(Global, Nil))
             {
-                Frame->Vars[Arg] = StackPop(Vm);
+                Global = Value;
+                WriteBarrier(Vm, NULL, Global);
             }
-            break;
+            VM_NEXT();
         }
 
-        case OpCode_Set:
+        VM_CASE(LoadNil):
         {
-            sl_call_frame *LookFrame = Frame;
-            bool Set = false;
-            while (LookFrame)
-            {
-                if (!Is(LookFrame->Vars[Arg], Nil))
-                {
-                    LookFrame->Vars[Arg] = StackPop(Vm);
-                    Set = true;
-                }
-                LookFrame = LookFrame->Parent;
-            }
-            if (!Set)
+            VM_PUSH(sl_value{});
+            VM_NEXT();
+        }
+
+        VM_CASE(Jump):
+        {
+            Ip = Frame->Func->Code.Data + Arg;
+            VM_NEXT();
+        }
+
+        VM_CASE(JumpIfFalse):
+        {
+            sl_value Value = VM_POP();
+            if (IsFalse(Value))
             {
-                std::string Str(Script->Strings[Arg].Value);
-                Vm->Globals[Str] = StackPop(Vm);
+                Ip = Frame->Func->Code.Data + Arg;
             }
-            break;
+            VM_NEXT();
         }
 
-        case OpCode_Defun:
+        VM_CASE(LoadBool):
         {
-            sl_value Value;
-            Value.Type = ValueType_Func;
-            Value.Func = Script->Funcs[Arg];
-            Frame->Vars[Value.Func->StringIndex] = Value;
-            break;
+            VM_PUSH(CreateBool(Arg == 1));
+            VM_NEXT();
         }
 
-        case OpCode_LoadBool:
+        VM_CASE(LoadNumber):
         {
-            sl_value Value;
-            Value.Type = ValueType_Bool;
-            Value.Bool = Arg == 1;
-            StackPush(Vm, Value);
-            break;
+            VM_PUSH(CreateDouble(Script->Numbers[Arg]));
+            VM_NEXT();
         }
 
-        case OpCode_LoadNumber:
+        VM_CASE(LoadFixnum):
         {
-            sl_value Value;
-            Value.Type = ValueType_Number;
-            Value.Number = Script->Numbers[Arg];
-            StackPush(Vm, Value);
-            break;
+            VM_PUSH(CreateFixnum(Script->Fixnums[Arg]));
+            VM_NEXT();
         }
 
-        case OpCode_LoadString:
+        VM_CASE(LoadString):
         {
-            sl_value Value;
-            Value.Type = ValueType_String;
-            Value.String = &Script->Strings[Arg];
-            IncRef(Value);
-            StackPush(Vm, Value);
-            break;
+            VM_PUSH(StringValue(&Script->Strings[Arg]));
+            VM_NEXT();
         }
 
-        case OpCode_LoadSymbol:
+        VM_CASE(LoadLocal):
         {
-            sl_call_frame *LookFrame = Frame;
-            bool Found = false;
-            while (LookFrame)
-            {
-                if (!Is(LookFrame->Vars[Arg], Nil))
-                {
-                    StackPush(Vm, LookFrame->Vars[Arg]);
-                    Found = true;
-                }
+            VM_PUSH(Vars[Arg]);
+            VM_NEXT();
+        }
 
-                LookFrame = LookFrame->Parent;
-            }
-            if (!Found)
-            {
-                std::string Str(Script->Strings[Arg].Value);
-                if (Vm->Globals.find(Str) != Vm->Globals.end())
-                {
-                    StackPush(Vm, Vm->Globals[Str]);
-                }
-                else
-                {
-                    StackPush(Vm, sl_value{});
-                }
-            }
-            break;
+        VM_CASE(LoadUpvalue):
+        {
+            VM_PUSH(AsCell(Frame->Closure->Upvalues[Arg])->Value);
+            VM_NEXT();
         }
 
-        case OpCode_LoadFunc:
+        VM_CASE(LoadCell):
         {
-            sl_value Value;
-            Value.Type = ValueType_Func;
-            Value.Func = Script->Funcs[Arg];
-            StackPush(Vm, Value);
-            break;
+            VM_PUSH(AsCell(Vars[Arg])->Value);
+            VM_NEXT();
         }
 
-        case OpCode_FuncCall:
+        VM_CASE(LoadGlobal):
+        {
+            VM_PUSH(*GlobalSlot(Vm, Script, Arg));
+            VM_NEXT();
+        }
+
+        VM_CASE(LoadSelf):
+        {
+            VM_PUSH(FrameCallee(Frame));
+            VM_NEXT();
+        }
+
+        VM_CASE(LoadFunc):
         {
-            sl_value *Args = new sl_value[Arg];
-            for (int i = Arg - 1; i >= 0; --i)
+            // creating a closure can collect, which scans the stack
+            VM_SAVE();
+            sl_value Value = CreateFunc(Vm, Script->Funcs[Arg], Frame);
+            VM_PUSH(Value);
+            VM_NEXT();
+        }
+
+        VM_CASE(FuncCall):
+        call:
+        {
+            VM_SAVE();
+            int Base = Vm->StackTop - Arg - 1;
+            sl_value FuncVal = Vm->Stack[Base];
+            if (Is(FuncVal, NativeFunc))
             {
-                Args[i] = StackPop(Vm);
-            }
+                // natives read their arguments in place and push the result
+                sl_native *Native = AsNative(FuncVal);
+                Native->Func(Native->Data, Vm, Vm->Stack + Base + 1, Arg);
+                if (Vm->CurrentFrame != Frame)
+                {
+                    // yield, go back to the call that resumed the coroutine
+                    goto end;
+                }
 
-            sl_value FuncVal = StackPop(Vm);
-            if (FuncVal.Type == ValueType_NativeFunc)
+                int ArgsEnd = Base + 1 + Arg;
+                Vm->Stack[Base] = Vm->StackTop > ArgsEnd ? Vm->Stack[Vm->StackTop - 1] : sl_value{};
+                Vm->StackTop = Base + 1;
+            }
+            else if (Is(FuncVal, Func) || Is(FuncVal, Closure))
             {
-                FuncVal.Native->Func(FuncVal.Native->Data, Vm, Args, Arg);
+                sl_closure *Closure = Is(FuncVal, Closure) ? AsClosure(FuncVal) : NULL;
+                sl_func *Func = Closure ? Closure->Func : AsFunc(FuncVal);
+                PushCallFrame(Vm, Func, Closure, NULL, Arg);
             }
-            else if (FuncVal.Type == ValueType_Func)
+            else
             {
-                sl_func *Func = FuncVal.Func;
-                for (int i = 0; i < Func->ArgCount; i++)
-                {
-                    if (i >= Arg)
-                    {
-                        StackPush(Vm, sl_value{});
-                    }
-                    else
-                    {
-                        StackPush(Vm, Args[i]);
-                    }
-                }
-                PushCallFrame(Vm, Func->Code.Data);
+                printf("error: can't call a value of type %s\n", ValueTypeStrings[TypeOf(FuncVal)]);
+                Vm->Stack[Base] = sl_value{};
+                Vm->StackTop = Base + 1;
             }
-            break;
+            VM_LOAD();
+            VM_NEXT();
         }
 
-        case OpCode_Return:
+        VM_CASE(TailCall):
+        {
+            // the heap frame of a coroutine only has room for its own locals,
+            // and natives don't use a frame
+            sl_value FuncVal = Sp[-(int)Arg - 1];
+            if (Frame->Coroutine || !(Is(FuncVal, Func) || Is(FuncVal, Closure)))
+            {
+                goto call;
+            }
+
+            // the callee and its arguments move down to where the caller's
+            // were, the caller's frame is the top of the frame stack so the
+            // callee's reuses its slot
+            memmove(Vm->Stack + Frame->Base, Sp - Arg - 1, (Arg + 1)*sizeof(sl_value));
+            Vm->StackTop = Frame->Base + Arg + 1;
+            Vm->CurrentFrame = Frame->Parent;
+            FreeCallFrame(Vm, Frame);
+
+            sl_closure *Closure = Is(FuncVal, Closure) ? AsClosure(FuncVal) : NULL;
+            sl_func *Func = Closure ? Closure->Func : AsFunc(FuncVal);
+            PushCallFrame(Vm, Func, Closure, NULL, Arg);
+            VM_LOAD();
+            VM_NEXT();
+        }
+
+        VM_CASE(Add): BINARY_OP(Add, NumberAdd(A, B));
+        VM_CASE(Sub): BINARY_OP(Sub, NumberSub(A, B));
+        VM_CASE(Mul): BINARY_OP(Mul, NumberMul(A, B));
+        VM_CASE(Div): BINARY_OP(Div, NumberDiv(A, B));
+        VM_CASE(Lt): BINARY_OP(Lt, CreateBool(NumberLess(A, B)));
+        VM_CASE(Gt): BINARY_OP(Gt, CreateBool(NumberLess(B, A)));
+        VM_CASE(Eq): BINARY_OP(Eq, CreateBool(NumberEqual(A, B)));
+
+        VM_CASE(AddRR): REGISTER_OP(Add, NumberAdd(A, B), REGISTER(Ip[0]));
+        VM_CASE(SubRR): REGISTER_OP(Sub, NumberSub(A, B), REGISTER(Ip[0]));
+        VM_CASE(MulRR): REGISTER_OP(Mul, NumberMul(A, B), REGISTER(Ip[0]));
+        VM_CASE(DivRR): REGISTER_OP(Div, NumberDiv(A, B), REGISTER(Ip[0]));
+        VM_CASE(LtRR): REGISTER_OP(Lt, CreateBool(NumberLess(A, B)), REGISTER(Ip[0]));
+        VM_CASE(GtRR): REGISTER_OP(Gt, CreateBool(NumberLess(B, A)), REGISTER(Ip[0]));
+        VM_CASE(EqRR): REGISTER_OP(Eq, CreateBool(NumberEqual(A, B)), REGISTER(Ip[0]));
+        VM_CASE(AddSR): REGISTER_OP(Add, NumberAdd(A, B), VM_POP());
+        VM_CASE(SubSR): REGISTER_OP(Sub, NumberSub(A, B), VM_POP());
+        VM_CASE(MulSR): REGISTER_OP(Mul, NumberMul(A, B), VM_POP());
+        VM_CASE(DivSR): REGISTER_OP(Div, NumberDiv(A, B), VM_POP());
+        VM_CASE(LtSR): REGISTER_OP(Lt, CreateBool(NumberLess(A, B)), VM_POP());
+        VM_CASE(GtSR): REGISTER_OP(Gt, CreateBool(NumberLess(B, A)), VM_POP());
+        VM_CASE(EqSR): REGISTER_OP(Eq, CreateBool(NumberEqual(A, B)), VM_POP());
+
+        VM_CASE(Return):
         {
-            sl_call_frame *Parent = Vm->CurrentFrame->Parent;
-            delete Vm->CurrentFrame;
+            // a body ending in a definition leaves nothing to return
+            Vm->Stack[Frame->Base] = Sp > Vm->Stack + Frame->StackBase ? Sp[-1] : sl_value{};
+            Vm->StackTop = Frame->Base + 1;
+
+            sl_call_frame *Parent = Frame->Parent;
+            bool Finished = Frame == EntryFrame;
+            if (Frame->Coroutine)
+            {
+                Frame->Coroutine->Done = true;
+                Frame->Coroutine->Frame = NULL;
+            }
+            FreeCallFrame(Vm, Frame);
 
             Vm->CurrentFrame = Parent;
-            if (StopOnReturn)
+            if (Finished)
             {
                 goto end;
             }
-            break;
+            VM_LOAD();
+            VM_NEXT();
         }
 
-        case OpCode_Pop:
+        VM_CASE(Pop):
         {
-            // pop only if the next opcode is not a return
-            if (*Frame->CodePtr != OpCode_Return)
-            {
-                sl_value Value = StackPop(Vm);
-                DecRef(Value);
-            }
-            break;
+            Sp--;
+            VM_NEXT();
         }
 
-        case OpCode_Halt:
+        VM_CASE(Wide):
+        {
+            OpCode = (uint8)Arg;
+            Arg = (uint32)Ip[0] | ((uint32)Ip[1] << 8) | ((uint32)Ip[2] << 16) | ((uint32)Ip[3] << 24);
+            Ip += 4;
+            VM_PROFILE();
+#ifdef SL_THREADED_DISPATCH
+            goto *DispatchTable[OpCode];
+#else
+            goto dispatch;
+#endif
+        }
+
+        VM_CASE(Halt):
+        {
+            VM_SAVE();
             goto end;
+        }
 
+#ifndef SL_THREADED_DISPATCH
         default:
-            break;
+            VM_NEXT();
         }
     }
+#endif
 
 end:
     return;
@@ -1118,176 +5005,175 @@ end:
 
 inline void Execute(sl_vm *Vm, sl_script *Script)
 {
-    Vm->CurrentScript = Script;
-    Execute(Vm, Script, &Script->Code, false);
-}
-
-inline void CallScriptFunc(sl_vm *Vm, sl_value Value)
-{
-    if (Value.Type == ValueType_Func)
-    {
-        Execute(Vm, Vm->CurrentScript, &Value.Func->Code, true);
-    }
-    else
-    {
-        // @TODO: error
-    }
-}
-
-static long int
-GetFileSize(FILE *handle)
-{
-    long int result = 0;
+    // the top level has no locals, all of its variables are globals
+    sl_func Main;
+    Main.Code = Script->Code;
+    Main.StringIndex = -1;
+    Main.MaxStack = Script->MaxStack;
 
-    fseek(handle, 0, SEEK_END);
-    result = ftell(handle);
-    rewind(handle);
-
-    return result;
-}
-
-static const char *
-ReadFile(const char *filename, long int *Size = NULL)
-{
-    FILE *handle;
-#ifdef _WIN32
-    fopen_s(&handle, filename, "r");
-#else
-    handle = fopen(filename, "r");
-#endif
-
-    long int length = GetFileSize(handle);
-    char *buffer = new char[length + 1];
-    int i = 0;
-    char c = 0;
-    while ((c = fgetc(handle)) != EOF)
-    {
-        buffer[i++] = c;
-        if (i >= length) break;
-    }
-
-    buffer[i] = '\0';
-    fclose(handle);
-
-    if (Size)
-    {
-        *Size = length;
-    }
-    return (const char *)buffer;
+    // the slot a callee would be in
+    Vm->CurrentScript = Script;
+    EnsureStack(Vm, 1);
+    StackPush(Vm, sl_value{});
+    Execute(Vm, Script, &Main);
 }
 
 #define ARITH_OP_CHECK(Op)            \
     assert(ArgCount == 2); \
-    if (Args[0].Type != Args[1].Type) \
+    if (!IsNumber(Args[0]) || !IsNumber(Args[1])) \
     { \
-        printf("error: %s: different types (%s, %s)\n", \
+        printf("error: %s: invalid types (%s, %s)\n", \
                Op, \
-               ValueTypeStrings[Args[0].Type], \
-               ValueTypeStrings[Args[1].Type]); \
+               ValueTypeStrings[TypeOf(Args[0])], \
+               ValueTypeStrings[TypeOf(Args[1])]); \
         return; \
     }
 
-#define ARITH_OP_DEFAULT_INVALID_CASE(Op) \
-    printf("error: %s: invalid type (%s)\n", Op, ValueTypeStrings[Args[0].Type])
-
 NATIVE_FUNC(Add)
 {
     ARITH_OP_CHECK("+");
-    switch (Args[0].Type)
-    {
-    case ValueType_Number:
-        StackPush(Vm, CreateNumber(Args[0].Number + Args[1].Number));
-        break;
-
-    default:
-        ARITH_OP_DEFAULT_INVALID_CASE("+");
-        break;
-    }
+    StackPush(Vm, NumberAdd(Args[0], Args[1]));
 }
 
 NATIVE_FUNC(Sub)
 {
     ARITH_OP_CHECK("-");
-    switch (Args[0].Type)
-    {
-    case ValueType_Number:
-        StackPush(Vm, CreateNumber(Args[0].Number - Args[1].Number));
-        break;
-
-    default:
-        ARITH_OP_DEFAULT_INVALID_CASE("-");
-        break;
-    }
+    StackPush(Vm, NumberSub(Args[0], Args[1]));
 }
 
 NATIVE_FUNC(Mul)
 {
     ARITH_OP_CHECK("*");
-    switch (Args[0].Type)
-    {
-    case ValueType_Number:
-        StackPush(Vm, CreateNumber(Args[0].Number * Args[1].Number));
-        break;
-
-    default:
-        ARITH_OP_DEFAULT_INVALID_CASE("*");
-        break;
-    }
+    StackPush(Vm, NumberMul(Args[0], Args[1]));
 }
 
 NATIVE_FUNC(Div)
 {
     ARITH_OP_CHECK("/");
-    switch (Args[0].Type)
-    {
-    case ValueType_Number:
-        StackPush(Vm, CreateNumber(Args[0].Number / Args[1].Number));
-        break;
+    StackPush(Vm, NumberDiv(Args[0], Args[1]));
+}
 
-    default:
-        ARITH_OP_DEFAULT_INVALID_CASE("/");
-        break;
-    }
+NATIVE_FUNC(Lt)
+{
+    ARITH_OP_CHECK("<");
+    StackPush(Vm, CreateBool(NumberLess(Args[0], Args[1])));
 }
 
-NATIVE_FUNC(Println)
+NATIVE_FUNC(Gt)
 {
-    for (int i = 0; i < ArgCount; i++)
+    ARITH_OP_CHECK(">");
+    StackPush(Vm, CreateBool(NumberLess(Args[1], Args[0])));
+}
+
+// numbers compare by value whatever their type, otherwise values of different
+// types are never equal, strings compare by content and everything else by
+// identity
+NATIVE_FUNC(Eq)
+{
+    assert(ArgCount == 2);
+    bool Result = false;
+    if (IsNumber(Args[0]) && IsNumber(Args[1]))
     {
-        sl_value Arg = Args[i];
-        switch (Arg.Type)
+        Result = NumberEqual(Args[0], Args[1]);
+    }
+    else if (TypeOf(Args[0]) == TypeOf(Args[1]))
+    {
+        switch (TypeOf(Args[0]))
         {
         case ValueType_Nil:
-            printf("nil");
+            Result = true;
             break;
 
         case ValueType_Bool:
-            if (Arg.Bool)
-            {
-                printf("true");
-            }
-            else
-            {
-                printf("false");
-            }
+            Result = AsBool(Args[0]) == AsBool(Args[1]);
             break;
 
         case ValueType_String:
-            printf("%s", Arg.String->Value);
+            Result = AsString(Args[0])->Size == AsString(Args[1])->Size &&
+                memcmp(AsString(Args[0])->Value, AsString(Args[1])->Value, AsString(Args[0])->Size) == 0;
             break;
 
-        case ValueType_Number:
-            printf("%.4f", Arg.Number);
+        default:
+            Result = AsPointer(Args[0]) == AsPointer(Args[1]);
             break;
+        }
+    }
+    StackPush(Vm, CreateBool(Result));
+}
 
-        case ValueType_Coroutine:
-            printf("coroutine (%s)",
-                   Vm->CurrentScript->Strings[Arg.Coroutine->Func->StringIndex].Value);
-            break;
+// The shortest of %.15g and %.17g that reads back as the same double, with a
+// ".0" added when it would read back as a fixnum.
+static int FormatDouble(double Value, char *Buffer, int Size)
+{
+    if (Value != Value)
+    {
+        // the sign of a NaN depends on where it came from
+        return snprintf(Buffer, Size, "nan");
+    }
 
-        default:
+    int Length = snprintf(Buffer, Size, "%.15g", Value);
+    if (strtod(Buffer, NULL) != Value)
+    {
+        Length = snprintf(Buffer, Size, "%.17g", Value);
+    }
+    if (!strpbrk(Buffer, ".ein"))
+    {
+        Length += snprintf(Buffer + Length, Size - Length, ".0");
+    }
+    return Length;
+}
+
+// text of a value as println shows it, Scratch is used for numbers and has to
+// hold at least 32 bytes
+static const char *ValueText(sl_value Value, char *Scratch, int ScratchSize, int64_t *Size)
+{
+    switch (TypeOf(Value))
+    {
+    case ValueType_Nil:
+        *Size = 3;
+        return "nil";
+
+    case ValueType_Bool:
+        *Size = AsBool(Value) ? 4 : 5;
+        return AsBool(Value) ? "true" : "false";
+
+    case ValueType_Fixnum:
+        *Size = snprintf(Scratch, ScratchSize, "%lld", (long long)AsFixnum(Value));
+        return Scratch;
+
+    case ValueType_Double:
+        *Size = FormatDouble(AsDouble(Value), Scratch, ScratchSize);
+        return Scratch;
+
+    case ValueType_String:
+        *Size = AsString(Value)->Size;
+        return AsString(Value)->Value;
+
+    default:
+        return NULL;
+    }
+}
+
+NATIVE_FUNC(Println)
+{
+    char Scratch[64];
+    for (int i = 0; i < ArgCount; i++)
+    {
+        sl_value Arg = Args[i];
+        int64_t Size = 0;
+        const char *Text = ValueText(Arg, Scratch, sizeof(Scratch), &Size);
+        if (Text)
+        {
+            fwrite(Text, 1, Size, stdout);
+        }
+        else if (Is(Arg, Coroutine))
+        {
+            printf("coroutine (%s)",
+                   Vm->CurrentScript->Strings[AsCoroutine(Arg)->Func->StringIndex].Value);
+        }
+        else
+        {
             printf("println unimplemented for this type\n");
-            break;
         }
 
         if (i < ArgCount - 1)
@@ -1299,84 +5185,110 @@ NATIVE_FUNC(Println)
     StackPush(Vm, sl_value{});
 }
 
-NATIVE_FUNC(Read)
-{
-    const char *Filename = Args[0].String->Value;
-
-    long int Size;
-    const char *Content = ReadFile(Filename, &Size);
-    StackPush(Vm, CreateString(Vm, (char *)Content, (int)Size));
-}
-
-#define IsFalse(Value) ((Value.Type == ValueType_Bool && !Value.Bool) || (Value.Type == ValueType_Nil))
-NATIVE_FUNC(If)
+// concatenates its arguments into a new string
+NATIVE_FUNC(Str)
 {
-    assert(ArgCount == 3);
-    if (!IsFalse(Args[0]))
+    char Scratch[64];
+    int64_t Size = 0;
+    for (int i = 0; i < ArgCount; i++)
     {
-        CallScriptFunc(Vm, Args[1]);
+        int64_t ArgSize = 0;
+        if (!ValueText(Args[i], Scratch, sizeof(Scratch), &ArgSize))
+        {
+            printf("error: str: can't convert a value of type %s\n", ValueTypeStrings[TypeOf(Args[i])]);
+            StackPush(Vm, sl_value{});
+            return;
+        }
+        Size += ArgSize;
     }
-    else
+
+    // a collection can move the young strings in Args, so they're read again
+    sl_value Result = AllocString(Vm, Size);
+    char *Dest = AsString(Result)->Value;
+    for (int i = 0; i < ArgCount; i++)
     {
-        CallScriptFunc(Vm, Args[2]);
+        int64_t ArgSize = 0;
+        const char *Text = ValueText(Args[i], Scratch, sizeof(Scratch), &ArgSize);
+        memcpy(Dest, Text, ArgSize);
+        Dest += ArgSize;
     }
+    StackPush(Vm, Result);
 }
 
-NATIVE_FUNC(When)
+NATIVE_FUNC(Read)
 {
-    assert(ArgCount == 2);
-    if (!IsFalse(Args[0]))
-    {
-        CallScriptFunc(Vm, Args[1]);
-    }
-    else
+    const char *Filename = AsString(Args[0])->Value;
+
+    sl_file_data File = ReadFile(Filename);
+    if (!File.Data)
     {
+        printf("error: read: can't read '%s'\n", Filename);
         StackPush(Vm, sl_value{});
+        return;
     }
+
+    sl_value Value = CreateString(Vm, (char *)File.Data, File.Size);
+    AsString(Value)->MapSize = File.MapSize;
+    StackPush(Vm, Value);
 }
 
 NATIVE_FUNC(Coroutine)
 {
     assert(ArgCount >= 1);
-    sl_coroutine *Co = (sl_coroutine *)GetObject(&Vm->CoroutinePool);
+    sl_coroutine *Co = (sl_coroutine *)AllocObject(Vm, &Vm->CoroutinePool, ValueType_Coroutine,
+                                                   sizeof(sl_coroutine));
     Co->Frame = NULL;
-    Co->Func = Args[0].Func;
-    InitRef(Co, &Vm->CoroutinePool);
-
-    sl_value Value;
-    Value.Type = ValueType_Coroutine;
-    Value.Coroutine = Co;
-    StackPush(Vm, Value);
+    Co->Closure = Is(Args[0], Closure) ? AsClosure(Args[0]) : NULL;
+    Co->Func = Co->Closure ? Co->Closure->Func : AsFunc(Args[0]);
+    WriteBarrier(Vm, Co, Args[0]);
+    Co->Done = false;
+    Co->Saved = NULL;
+    Co->SavedCount = 0;
+
+    StackPush(Vm, CoroutineValue(Co));
 }
 
 NATIVE_FUNC(Call)
 {
     assert(ArgCount >= 1);
-    sl_coroutine *Co = Args[0].Coroutine;
+    sl_coroutine *Co = AsCoroutine(Args[0]);
 
+    if (Co->Done)
+    {
+        StackPush(Vm, sl_value{});
+        return;
+    }
     if (Co->Frame)
     {
-        if (*(Co->Frame->CodePtr - 2) == OpCode_Return)
+        // put the operands back on top of the stack, followed by the value
+        // returned by the yield the coroutine is paused at
+        sl_value Value = ArgCount > 1 ? Args[1] : sl_value{};
+        sl_call_frame *Frame = Co->Frame;
+        EnsureStack(Vm, 1 + Co->Func->MaxStack);
+        Frame->Base = Vm->StackTop;
+        StackPush(Vm, sl_value{});
+        Frame->StackBase = Vm->StackTop;
+        for (int i = 0; i < Co->SavedCount; i++)
         {
-            StackPush(Vm, sl_value{});
-            return;
+            StackPush(Vm, Co->Saved[i]);
         }
-        else
+        delete[] Co->Saved;
+        Co->Saved = NULL;
+        Co->SavedCount = 0;
+        StackPush(Vm, Value);
+        Execute(Vm, Vm->CurrentScript, Co->Func, Co->Closure, Co);
+    }
+    else
+    {
+        // the first call passes the function arguments
+        int ArgsIndex = Args - Vm->Stack;
+        EnsureStack(Vm, ArgCount);
+        for (int i = 1; i < ArgCount; i++)
         {
-            if (ArgCount > 1)
-            {
-                for (int i = 1; i < ArgCount; i++)
-                {
-                    StackPush(Vm, Args[i]);
-                }
-            }
-            else
-            {
-                StackPush(Vm, sl_value{});
-            }
+            StackPush(Vm, Vm->Stack[ArgsIndex + i]);
         }
+        Execute(Vm, Vm->CurrentScript, Co->Func, Co->Closure, Co, ArgCount - 1);
     }
-    Execute(Vm, Vm->CurrentScript, &Co->Func->Code, true, Co);
 }
 
 NATIVE_FUNC(Yield)
@@ -1385,35 +5297,51 @@ NATIVE_FUNC(Yield)
     sl_coroutine *Co = Frame->Coroutine;
     if (Co)
     {
-        if (ArgCount > 0)
+        // operands of the body below the yield call get saved until resumed
+        sl_value Value = ArgCount > 0 ? Args[0] : sl_value{};
+        int CallBase = (Args - Vm->Stack) - 1;
+        Co->SavedCount = CallBase - Frame->StackBase;
+        if (Co->SavedCount > 0)
         {
-            StackPush(Vm, Args[0]);
+            Co->Saved = new sl_value[Co->SavedCount];
+            for (int i = 0; i < Co->SavedCount; i++)
+            {
+                Co->Saved[i] = Vm->Stack[Frame->StackBase + i];
+            }
         }
-        else
+
+        // the frame leaves the roots, so its locals and operands have to be
+        // shaded in case the coroutine was already traced
+        if (Vm->GCPhase == GCPhase_Mark)
         {
-            StackPush(Vm, sl_value{});
+            MarkFrame(Vm, Frame);
+            for (int i = 0; i < Co->SavedCount; i++)
+            {
+                MarkValue(Vm, Co->Saved[i]);
+            }
         }
+
+        // and it can point to young objects without going through
+        // WriteBarrier
+        Remember(Vm, Co);
+
+        Vm->Stack[Frame->Base] = Value;
+        Vm->StackTop = Frame->Base + 1;
         Vm->CurrentFrame = Frame->Parent;
         Co->Frame = Frame;
     }
     else
     {
-        // @TODO: error
+        printf("error: yield: not called from the body of a coroutine\n");
+        StackPush(Vm, sl_value{});
     }
 }
 
 NATIVE_FUNC(Done)
 {
     assert(ArgCount >= 1);
-    sl_coroutine *Co = Args[0].Coroutine;
-    if (Co->Frame)
-    {
-        StackPush(Vm, CreateBool(*(Co->Frame->CodePtr - 2) == OpCode_Return));
-    }
-    else
-    {
-        StackPush(Vm, CreateBool(false));
-    }
+    sl_coroutine *Co = AsCoroutine(Args[0]);
+    StackPush(Vm, CreateBool(Co->Done));
 }
 
 void InitVM(sl_vm *Vm)
@@ -1421,19 +5349,40 @@ void InitVM(sl_vm *Vm)
 #ifdef SL_DEBUG
     Vm->StringPool.DEBUGName = "StringPool";
     Vm->CoroutinePool.DEBUGName = "CoroutinePool";
+    Vm->ClosurePool.DEBUGName = "ClosurePool";
+    Vm->NativePool.DEBUGName = "NativePool";
+    Vm->CellPool.DEBUGName = "CellPool";
 #endif
 
     Vm->StringPool.ElemSize = sizeof(sl_string);
     Vm->CoroutinePool.ElemSize = sizeof(sl_coroutine);
+    Vm->ClosurePool.ElemSize = sizeof(sl_closure);
+    Vm->NativePool.ElemSize = sizeof(sl_native);
+    Vm->CellPool.ElemSize = sizeof(sl_cell);
+    Vm->NextCollection = Vm->GCMinHeap;
+
+    // only touched as frames get pushed
+    Vm->Frames = (sl_call_frame *)malloc(MaxFrames*sizeof(sl_call_frame));
+    EnsureStack(Vm, InitialStackSize);
+    if (Vm->NurserySize)
+    {
+        Vm->Nursery = (char *)malloc(Vm->NurserySize);
+    }
+    for (int i = 0; i < RegBranch - RegImmediate; i++)
+    {
+        Vm->RegisterImmediates[i] = CreateFixnum(i + RegImmediate - RegImmediateBias);
+    }
 
     RegisterNativeFunc(Vm, "+", Add, NULL);
     RegisterNativeFunc(Vm, "-", Sub, NULL);
     RegisterNativeFunc(Vm, "*", Mul, NULL);
     RegisterNativeFunc(Vm, "/", Div, NULL);
+    RegisterNativeFunc(Vm, "<", Lt, NULL);
+    RegisterNativeFunc(Vm, ">", Gt, NULL);
+    RegisterNativeFunc(Vm, "=", Eq, NULL);
     RegisterNativeFunc(Vm, "println", Println, NULL);
+    RegisterNativeFunc(Vm, "str", Str, NULL);
     RegisterNativeFunc(Vm, "read", Read, NULL);
-    RegisterNativeFunc(Vm, "if", If, NULL);
-    RegisterNativeFunc(Vm, "when", When, NULL);
     RegisterNativeFunc(Vm, "coroutine", Coroutine, NULL);
     RegisterNativeFunc(Vm, "call", Call, NULL);
     RegisterNativeFunc(Vm, "yield", Yield, NULL);